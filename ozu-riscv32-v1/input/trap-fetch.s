@@ -0,0 +1,31 @@
+# misaligned jump targets: jal, jalr and a taken branch trap with the
+# target in mtval before writing rd or pc, a not-taken branch does not
+.text
+start:
+    la t0, handler
+    csrw mtvec, t0
+    li ra, 0x55
+    li s1, 0x66
+    jal ra, 6               # misaligned jal target
+    la t1, start
+    addi t1, t1, 2
+    jalr s1, 0(t1)          # misaligned jalr target
+    li t2, 1
+    beq t2, t2, 10          # misaligned taken branch
+    bne t2, t2, 6           # not taken: no trap
+    csrw mtvec, zero        # exit through the host
+    mv a0, s0
+    li a7, 93
+    ecall
+handler:
+    addi s0, s0, 1          # traps taken
+    csrr s2, mcause
+    mv s3, s4               # mtval of the last three traps in s5, s4, s3
+    mv s4, s5
+    csrr s5, mtval
+    mv s6, s7               # mepc of the last three traps in s8, s7, s6
+    mv s7, s8
+    csrr s8, mepc
+    addi t3, s8, 4
+    csrw mepc, t3
+    mret
@@ -0,0 +1,23 @@
+# illegal-instruction trap: the handler records mcause, mtval and mepc,
+# steps mepc over the faulting word and returns with mret
+.text
+start:
+    la t0, handler
+    csrw mtvec, t0
+    li s1, 0x11
+    .word 0x00000000        # illegal
+    li s1, 0x22
+    .word 0xffffffff        # illegal
+    li s1, 0x33
+    csrw mtvec, zero        # exit through the host
+    mv a0, s0
+    li a7, 93
+    ecall
+handler:
+    addi s0, s0, 1          # traps taken
+    csrr s2, mcause
+    csrr s3, mtval
+    csrr s4, mepc
+    addi t1, s4, 4
+    csrw mepc, t1
+    mret
@@ -0,0 +1,28 @@
+# timer interrupt: mtimecmp is set through the custom CSRs 0x7C0/0x7C1,
+# the handler pushes it forward until three interrupts were taken
+.text
+start:
+    la t0, handler
+    csrw mtvec, t0
+    li t0, 100
+    csrw 0x7C0, t0          # mtimecmp = 100
+    csrwi 0x7C1, 0
+    li t0, 0x80             # MTIE
+    csrw mie, t0
+    csrsi mstatus, 8        # MIE
+wait:
+    addi s0, s0, 1
+    li t1, 3
+    blt s1, t1, wait
+    csrw mie, zero
+    csrw mtvec, zero        # exit through the host
+    mv a0, s1
+    li a7, 93
+    ecall
+handler:
+    addi s1, s1, 1          # interrupts taken
+    csrr s2, mcause
+    csrr s3, 0x7C0
+    addi t2, s3, 100
+    csrw 0x7C0, t2
+    mret
@@ -0,0 +1,36 @@
+# U-mode: mcounteren lets instret through but blocks cycle, whose read
+# traps as an illegal instruction; ecall from U-mode traps with cause 8
+.text
+start:
+    la t0, handler
+    csrw mtvec, t0
+    li t0, 4                # IR only
+    csrw mcounteren, t0
+    la t0, user
+    csrw mepc, t0
+    csrw mstatus, zero      # MPP = U
+    mret
+user:
+    csrr s1, instret
+    csrr s2, cycle          # illegal: mcounteren.CY is clear
+    li s3, 0x33
+    ecall                   # cause 8
+    li s4, 0x44             # not reached
+handler:
+    addi s0, s0, 1          # traps taken
+    csrr t1, mcause
+    li t2, 8
+    beq t1, t2, uecall
+    mv s5, t1
+    csrr s6, mtval
+    csrr t3, mepc
+    addi t3, t3, 4
+    csrw mepc, t3
+    mret
+uecall:
+    mv s7, t1
+    csrr s8, mstatus        # MPP shows the trap came from U-mode
+    csrw mtvec, zero        # exit through the host
+    mv a0, s0
+    li a7, 93
+    ecall
@@ -3,6 +3,16 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 #include "ozu-riscv32.h"
 
@@ -15,53 +25,218 @@ void help() {
     printf("\t**********OZU-RV32 Disassembler and Simulator Help MENU**********\n\n");
     printf("sim\t-- simulate program to completion \n");
     printf("run <n>\t-- simulate program for <n> instructions\n");
-    printf("rdump\t-- dump register values\n");
+    printf("rdump [json]\t-- dump register values\n");
     printf("reset\t-- clears all registers/memory and re-loads the program\n");
     printf("input <reg> <val>\t-- set GPR <reg> to <val>\n");
-    printf("mdump <start> <stop>\t-- dump memory from <start> to <stop> address\n");
+    printf("irq <0|1>\t-- clear/raise the external interrupt line\n");
+    printf("mdump <start> <stop> [json]\t-- dump memory from <start> to <stop> address\n");
     printf("print\t-- print the program loaded into memory\n");
+    printf("stats [json]\t-- print performance counters (Prometheus text or JSON)\n");
     printf("?\t-- display help menu\n");
-    printf("quit\t-- exit the simulator\n\n");
+    printf("quit\t-- exit the simulator\n");
+    printf("commands can be separated by ';'\n\n");
     printf("------------------------------------------------------------------\n\n");
 }
 
 /***************************************************************/
-/* Read a 32-bit word from memory                              */
+/* Host address of [address, address+size) if it lies inside  */
+/* a single memory region, NULL otherwise                      */
 /***************************************************************/
-uint32_t mem_read_32(uint32_t address)
+static inline uint8_t *mem_host_ptr(uint32_t address, uint32_t size)
 {
     int i;
     for (i = 0; i < NUM_MEM_REGION; i++) {
-        if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
-            uint32_t offset = address - MEM_REGIONS[i].begin;
-            return (MEM_REGIONS[i].mem[offset+3] << 24) |
-                    (MEM_REGIONS[i].mem[offset+2] << 16) |
-                    (MEM_REGIONS[i].mem[offset+1] <<  8) |
-                    (MEM_REGIONS[i].mem[offset+0] <<  0);
+        /* unsigned wrap-around also rejects address < begin */
+        if (address - MEM_REGIONS[i].begin <= MEM_REGIONS[i].end - MEM_REGIONS[i].begin - (size - 1)) {
+            return MEM_REGIONS[i].mem + (address - MEM_REGIONS[i].begin);
         }
     }
+    return NULL;
+}
+
+/***************************************************************/
+/* Little-endian load/store of 1, 2 or 4 bytes of host memory  */
+/***************************************************************/
+static inline uint32_t host_load(const uint8_t *p, uint32_t size)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint8_t v8;
+    uint16_t v16;
+    uint32_t v32;
+    switch (size) {
+        case 1:  memcpy(&v8, p, 1);  return v8;
+        case 2:  memcpy(&v16, p, 2); return v16;
+        default: memcpy(&v32, p, 4); return v32;
+    }
+#else
+    uint32_t i, value = 0;
+    for (i = 0; i < size; i++) {
+        value |= (uint32_t)p[i] << (i * 8);
+    }
+    return value;
+#endif
+}
+
+static inline void host_store(uint8_t *p, uint32_t value, uint32_t size)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint8_t v8 = value;
+    uint16_t v16 = value;
+    switch (size) {
+        case 1:  memcpy(p, &v8, 1);     break;
+        case 2:  memcpy(p, &v16, 2);    break;
+        default: memcpy(p, &value, 4);  break;
+    }
+#else
+    uint32_t i;
+    for (i = 0; i < size; i++) {
+        p[i] = (value >> (i * 8)) & 0xFF;
+    }
+#endif
+}
+
+/***************************************************************/
+/* Misaligned accesses, handled according to MEM_ALIGN_POLICY  */
+/***************************************************************/
+uint32_t mem_read_misaligned(uint32_t address, uint32_t size)
+{
+    uint8_t *p;
+    uint32_t i, value = 0;
+
+    COUNTERS.misaligned++;
+    switch (MEM_ALIGN_POLICY) {
+        case MEM_ALIGN_TRAP:
+            raise_exception(CAUSE_LOAD_MISALIGNED, address);
+            return 0;
+        case MEM_ALIGN_ALLOW:
+            p = mem_host_ptr(address, size);
+            return p ? host_load(p, size) : 0;
+        default: /* byte by byte, may cross into the next region */
+            for (i = 0; i < size; i++) {
+                p = mem_host_ptr(address + i, 1);
+                value |= (p ? *p : 0) << (i * 8);
+            }
+            return value;
+    }
+}
+
+void mem_write_misaligned(uint32_t address, uint32_t value, uint32_t size)
+{
+    uint8_t *p;
+    uint32_t i;
+
+    COUNTERS.misaligned++;
+    switch (MEM_ALIGN_POLICY) {
+        case MEM_ALIGN_TRAP:
+            raise_exception(CAUSE_STORE_MISALIGNED, address);
+            break;
+        case MEM_ALIGN_ALLOW:
+            p = mem_host_ptr(address, size);
+            if (p) {
+                host_store(p, value, size);
+            }
+            break;
+        default:
+            for (i = 0; i < size; i++) {
+                p = mem_host_ptr(address + i, 1);
+                if (p) {
+                    *p = (value >> (i * 8)) & 0xFF;
+                }
+            }
+            break;
+    }
+}
+
+/***************************************************************/
+/* Read 1, 2 or 4 bytes from memory                            */
+/***************************************************************/
+static inline uint32_t mem_read(uint32_t address, uint32_t size)
+{
+    uint8_t *p;
+
+    if (address & (size - 1)) {
+        return mem_read_misaligned(address, size);
+    }
+    /* aligned accesses never straddle two regions */
+    p = mem_host_ptr(address, size);
+    if (p) {
+        return host_load(p, size);
+    }
+    COUNTERS.unmapped++;
     return 0;
 }
 
+uint8_t mem_read_8(uint32_t address)
+{
+    return mem_read(address, 1);
+}
+
+uint16_t mem_read_16(uint32_t address)
+{
+    return mem_read(address, 2);
+}
+
+uint32_t mem_read_32(uint32_t address)
+{
+    return mem_read(address, 4);
+}
+
 /***************************************************************/
-/* Write a 32-bit word to memory                               */
+/* Read a word for the debugger, whatever its alignment        */
 /***************************************************************/
+uint32_t mem_peek_32(uint32_t address)
+{
+    uint8_t *p;
+    uint32_t i, value = 0;
 
-void mem_write_32(uint32_t address, uint32_t value)
+    for (i = 0; i < 4; i++) {
+        p = mem_host_ptr(address + i, 1);
+        value |= (p ? *p : 0) << (i * 8);
+    }
+    return value;
+}
+
+/***************************************************************/
+/* Write 1, 2 or 4 bytes to memory                             */
+/***************************************************************/
+static inline void mem_write(uint32_t address, uint32_t value, uint32_t size)
 {
-    int i;
-    uint32_t offset;
-    for (i = 0; i < NUM_MEM_REGION; i++) {
-        if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
-            offset = address - MEM_REGIONS[i].begin;
+    uint8_t *p;
 
-            MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-            MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-            MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-            MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
+    if (address & (size - 1)) {
+        mem_write_misaligned(address, value, size);
+    } else if ((p = mem_host_ptr(address, size)) != NULL) {
+        host_store(p, value, size);
+    } else {
+        COUNTERS.unmapped++;
+    }
+    /* code may run from any region, no store may leave stale decoded instructions behind */
+    invalidate_decode_cache(address);
+    invalidate_decode_cache(address + size - 1);
+    if (address <= MEM_TEXT_END) {
+        uint32_t first = address < MEM_TEXT_BEGIN ? 0 : (address - MEM_TEXT_BEGIN) >> 2;
+        /* the predecoded program may be shared, stop using it from the modified word on */
+        if (address + size - 1 >= MEM_TEXT_BEGIN && first < PREDECODED_WORDS) {
+            PREDECODED_WORDS = first;
         }
     }
 }
+
+void mem_write_8(uint32_t address, uint8_t value)
+{
+    mem_write(address, value, 1);
+}
+
+void mem_write_16(uint32_t address, uint16_t value)
+{
+    mem_write(address, value, 2);
+}
+
+void mem_write_32(uint32_t address, uint32_t value)
+{
+    mem_write(address, value, 4);
+}
+
 /***************************************************************/
 /* Execute one cycle                                           */
 /***************************************************************/
@@ -69,6 +244,17 @@ void cycle() {
     handle_instruction();
     CURRENT_STATE = NEXT_STATE;
     INSTRUCTION_COUNT++;
+    MTIME++;
+    TRAP_RAISED = FALSE;
+}
+
+/***************************************************************/
+/* Monotonic host time in nanoseconds                          */
+/***************************************************************/
+static uint64_t host_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
 /***************************************************************/
@@ -77,19 +263,21 @@ void cycle() {
 void run(int num_cycles) {                                      
     
     if (RUN_FLAG == FALSE) {
-        printf("Simulation Stopped\n\n");
+        if (!QUIET) printf("Simulation Stopped\n\n");
         return;
     }
 
-    printf("Running simulator for %d cycles...\n\n", num_cycles);
+    if (!QUIET) printf("Running simulator for %d cycles...\n\n", num_cycles);
+    uint64_t start = host_time_ns();
     int i;
     for (i = 0; i < num_cycles; i++) {
         if (RUN_FLAG == FALSE) {
-            printf("Simulation Stopped.\n\n");
+            if (!QUIET) printf("Simulation Stopped.\n\n");
             break;
         }
         cycle();
     }
+    COUNTERS.host_ns += host_time_ns() - start;
 }
 
 /***************************************************************/
@@ -97,15 +285,17 @@ void run(int num_cycles) {
 /***************************************************************/
 void runAll() {                                                     
     if (RUN_FLAG == FALSE) {
-        printf("Simulation Stopped.\n\n");
+        if (!QUIET) printf("Simulation Stopped.\n\n");
         return;
     }
 
-    printf("Simulation Started...\n\n");
+    if (!QUIET) printf("Simulation Started...\n\n");
+    uint64_t start = host_time_ns();
     while (RUN_FLAG){
         cycle();
     }
-    printf("Simulation Finished.\n\n");
+    COUNTERS.host_ns += host_time_ns() - start;
+    if (!QUIET) printf("Simulation Finished.\n\n");
 }
 
 /**************************************************************************************/ 
@@ -119,7 +309,7 @@ void mdump(uint32_t start, uint32_t stop) {
     printf("-------------------------------------------------------------\n");
     printf("\t[Address in Hex (Dec) ]\t[Value]\n");
     for (address = start; address <= stop; address += 4){
-        printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(address));
+        printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_peek_32(address));
     }
     printf("\n");
 }
@@ -132,7 +322,7 @@ void rdump() {
     printf("-------------------------------------\n");
     printf("Dumping Register Content\n");
     printf("-------------------------------------\n");
-    printf("# Instructions Executed\t: %u\n", INSTRUCTION_COUNT);
+    printf("# Instructions Executed\t: %" PRIu64 "\n", INSTRUCTION_COUNT);
     printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
     printf("-------------------------------------\n");
     printf("[Register]\t[Value]\n");
@@ -145,50 +335,109 @@ void rdump() {
 }
 
 /***************************************************************/
-/* Read a command from standard input.                         */  
+/* Dump region of memory as a single JSON object               */
 /***************************************************************/
-void handle_command() {                         
-    char buffer[20];
-    uint32_t start, stop, cycles;
-    uint32_t register_no;
-    int register_value;
+void mdump_json(uint32_t start, uint32_t stop) {
+    uint32_t address;
 
-    printf("OZU-RISCV SIM:> ");
+    printf("{\"start\":%u,\"stop\":%u,\"words\":[", start, stop);
+    for (address = start; address <= stop; address += 4){
+        printf("%s%u", address == start ? "" : ",", mem_peek_32(address));
+        if (address > UINT32_MAX - 4) {
+            break;
+        }
+    }
+    printf("]}\n");
+}
 
-    if (scanf("%s", buffer) == EOF){
-        exit(0);
+/***************************************************************/
+/* Dump registers as a single JSON object                      */
+/***************************************************************/
+void rdump_json() {
+    int i;
+
+    printf("{\"instructions\":%" PRIu64 ",\"pc\":%u,\"regs\":[", INSTRUCTION_COUNT, CURRENT_STATE.PC);
+    for (i = 0; i < RISCV_REGS; i++){
+        printf("%s%u", i ? "," : "", CURRENT_STATE.REGS[i]);
+    }
+    printf("]}\n");
+}
+
+/***************************************************************/
+/* Leave the simulator                                         */
+/***************************************************************/
+void quit(int status) {
+    if (!QUIET) {
+        printf("**************************\n");
+        printf("Exiting OZU-RISCV! Good Bye...\n");
+        printf("**************************\n");
+    }
+    exit(status);
+}
+
+/***************************************************************/
+/* Execute a single command, e.g. "mdump 10000000 10000040"    */
+/***************************************************************/
+void execute_command(char *command) {
+    char *argv[MAX_COMMAND_ARGS];
+    int argc = 0, json = JSON_DUMPS;
+    uint32_t start, stop, register_no;
+    int cycles, register_value;
+    char *token;
+
+    for (token = strtok(command, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+        if (argc < MAX_COMMAND_ARGS) {
+            argv[argc++] = token;
+        }
+    }
+    if (argc == 0) {
+        return;
+    }
+    /* optional trailing output format of the dump commands */
+    if (argc > 1 && (strcmp(argv[argc - 1], "json") == 0 || strcmp(argv[argc - 1], "text") == 0)) {
+        json = argv[--argc][0] == 'j';
     }
 
-    switch(buffer[0]) {
+    switch(argv[0][0]) {
         case 'S':
         case 's':
+            if (argv[0][1] == 't' || argv[0][1] == 'T') {
+                print_stats(stdout, json ? STATS_JSON : STATS_PROM);
+                break;
+            }
             runAll(); 
             break;
         case 'M':
         case 'm':
-            if (scanf("%x %x", &start, &stop) != 2){
+            if (argc < 3 || sscanf(argv[1], "%x", &start) != 1 || sscanf(argv[2], "%x", &stop) != 1){
                 break;
             }
-            mdump(start, stop);
+            if (json) {
+                mdump_json(start, stop);
+            } else {
+                mdump(start, stop);
+            }
             break;
         case '?':
             help();
             break;
         case 'Q':
         case 'q':
-            printf("**************************\n");
-            printf("Exiting OZU-RISCV! Good Bye...\n");
-            printf("**************************\n");
-            exit(0);
+            quit(0);
+            break;
         case 'R':
         case 'r':
-            if (buffer[1] == 'd' || buffer[1] == 'D'){
-                rdump();
-            }else if(buffer[1] == 'e' || buffer[1] == 'E'){
+            if (argv[0][1] == 'd' || argv[0][1] == 'D'){
+                if (json) {
+                    rdump_json();
+                } else {
+                    rdump();
+                }
+            }else if(argv[0][1] == 'e' || argv[0][1] == 'E'){
                 reset();
             }
             else {
-                if (scanf("%d", &cycles) != 1) {
+                if (argc < 2 || sscanf(argv[1], "%d", &cycles) != 1) {
                     break;
                 }
                 run(cycles);
@@ -196,7 +445,19 @@ void handle_command() {
             break;
         case 'I':
         case 'i':
-            if (scanf("%u %i", &register_no, &register_value) != 2){
+            if (argv[0][1] == 'r' || argv[0][1] == 'R') {
+                if (argc < 2) {
+                    break;
+                }
+                set_external_interrupt(strcmp(argv[1], "0") != 0);
+                break;
+            }
+            if (argc < 3 || sscanf(argv[1], "%u", &register_no) != 1 ||
+                sscanf(argv[2], "%i", &register_value) != 1){
+                break;
+            }
+            if (register_no >= RISCV_REGS) {
+                printf("Invalid Register.\n");
                 break;
             }
             CURRENT_STATE.REGS[register_no] = register_value;
@@ -212,6 +473,59 @@ void handle_command() {
     }
 }
 
+/***************************************************************/
+/* Execute a ';' or newline separated list of commands         */
+/***************************************************************/
+void execute_commands(char *commands) {
+    char *next;
+
+    while (commands != NULL) {
+        next = strpbrk(commands, ";\n");
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        execute_command(commands);
+        commands = next;
+    }
+}
+
+/***************************************************************/
+/* Execute every line of a command file                        */
+/***************************************************************/
+void execute_command_file(const char *file_name) {
+    char *line = NULL;
+    size_t line_size = 0;
+    FILE *fp;
+
+    fp = fopen(file_name, "r");
+    if (fp == NULL) {
+        printf("Error: Can't open command file %s\n", file_name);
+        exit(-1);
+    }
+    while (getline(&line, &line_size, fp) != -1) {
+        execute_commands(line);
+    }
+    free(line);
+    fclose(fp);
+}
+
+/***************************************************************/
+/* Read a command from standard input.                         */  
+/***************************************************************/
+void handle_command() {                         
+    static char *line = NULL;
+    static size_t line_size = 0;
+
+    if (!QUIET) {
+        printf("OZU-RISCV SIM:> ");
+    }
+
+    if (getline(&line, &line_size, stdin) == -1){
+        exit(0);
+    }
+    execute_commands(line);
+}
+
 /***************************************************************/
 /* reset registers/memory and reload program                   */
 /***************************************************************/
@@ -222,30 +536,56 @@ void reset() {
         CURRENT_STATE.REGS[i] = 0;
     }
     
-    for (i = 0; i < NUM_MEM_REGION; i++) {
-        uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-        memset(MEM_REGIONS[i].mem, 0, region_size);
-    }
+    clear_memory();
     
     /*load program*/
     load_program();
     
     /*reset PC*/
     INSTRUCTION_COUNT = 0;
+    EXIT_STATUS = 0;
+    reset_trap_state();
+    reset_counters();
     CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
     NEXT_STATE = CURRENT_STATE;
     RUN_FLAG = TRUE;
 }
 
 /***************************************************************/
-/* Allocate and set memory to zero                             */
+/* Map [addr, addr+size) as zero filled memory that only takes */
+/* host pages once touched. Mapping over an existing region    */
+/* drops all of its pages at once.                             */
+/***************************************************************/
+static uint8_t *map_region(uint8_t *addr, uint32_t size) {
+    uint8_t *mem = mmap(addr, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | (addr ? MAP_FIXED : 0), -1, 0);
+    if (mem == MAP_FAILED) {
+        printf("Error: Can't reserve %u bytes of memory\n", size);
+        exit(-1);
+    }
+    return mem;
+}
+
+/***************************************************************/
+/* Reserve memory, every byte reads as zero                    */
 /***************************************************************/
 void init_memory() {                                           
     int i;
     for (i = 0; i < NUM_MEM_REGION; i++) {
         uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-        MEM_REGIONS[i].mem = malloc(region_size);
-        memset(MEM_REGIONS[i].mem, 0, region_size);
+        MEM_REGIONS[i].mem = map_region(NULL, region_size);
+    }
+}
+
+/***************************************************************/
+/* Set all memory back to zero, in time independent of the     */
+/* region sizes                                                */
+/***************************************************************/
+void clear_memory() {
+    int i;
+    for (i = 0; i < NUM_MEM_REGION; i++) {
+        uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
+        map_region(MEM_REGIONS[i].mem, region_size);
     }
 }
 
@@ -254,7 +594,9 @@ void init_memory() {
 /**************************************************************/
 void load_program() {                   
     FILE * fp;
-    int i, word;
+    int word;
+    uint32_t i, capacity = 4096;
+    uint8_t *image = malloc(capacity);
     uint32_t address;
 
     /* Open program file. */
@@ -268,233 +610,891 @@ void load_program() {
     i = 0;
     while( fscanf(fp, "%x\n", &word) != EOF ) {
         address = MEM_TEXT_BEGIN + i;
-        mem_write_32(address, word);
-        printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
+        if (i > MEM_TEXT_END - MEM_TEXT_BEGIN) {
+            printf("Error: Program does not fit into the text segment\n");
+            exit(-1);
+        }
+        if (i == capacity) {
+            capacity *= 2;
+            image = realloc(image, capacity);
+        }
+        host_store(image + i, word, 4);
+        if (!QUIET) {
+            printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
+        }
         i += 4;
     }
-    PROGRAM_SIZE = i/4;
-    printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
     fclose(fp);
+    PROGRAM_SIZE = i/4;
+    PROGRAM_HASH = hash_bytes(image, i, HASH_SEED);
+
+    /* map the image shared with other instances, or copy it into private memory */
+    if (SHARE_DIR != NULL && map_shared_image(image, i)) {
+        load_predecoded(image, PROGRAM_SIZE, TRUE);
+    } else {
+        memcpy(MEM_REGIONS[0].mem, image, i);
+        load_predecoded(image, PROGRAM_SIZE, FALSE);
+    }
+    free(image);
+    flush_decode_cache();
+
+    if (!QUIET) {
+        printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
+    }
 }
 
 /************************************************************/
-/* decode and execute instruction                           */ 
+/* Program images and predecoded programs shared between    */
+/* instances through SHARE_DIR, named by content hash       */
 /************************************************************/
-void handle_instruction()
-{
-    uint32_t current_ins = mem_read_32(CURRENT_STATE.PC);
-    uint32_t opcode = current_ins & 0x7F;
-    uint32_t rd, funct3, rs1, rs2, funct7, imm, shamt;
-    int32_t imm_sext;
-
-
-    NEXT_STATE.PC = CURRENT_STATE.PC + 4; 
-
-    if (opcode == 0x33) { //R-type instructions
-        uint32_t rd = (current_ins >> 7) & 0x1F; 
-        uint32_t funct3 = (current_ins >> 12) & 0x07; 
-        uint32_t rs1 = (current_ins >> 15) & 0x1F; 
-        uint32_t rs2 = (current_ins >> 20) & 0x1F; 
-        uint32_t funct7 = (current_ins >> 25) & 0x7F; 
-
-        if (funct7 == 0x00) { 
-            if (funct3 == 0x0) { // ADD
-                NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] + CURRENT_STATE.REGS[rs2];
-            } else if (funct3 == 0x1) { // SLL or shift left logical   
-                NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] << (CURRENT_STATE.REGS[rs2] & 0x1F);
-            } else if (funct3 == 0x2) { // SLT or set less than
-                NEXT_STATE.REGS[rd] = ((int32_t)CURRENT_STATE.REGS[rs1] < (int32_t)CURRENT_STATE.REGS[rs2]) ? 1 : 0;
-            } else if (funct3 == 0x4) { // XOR
-                NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] ^ CURRENT_STATE.REGS[rs2];
-            } else if (funct3 == 0x5) { // SRL or shift right logical
-                 NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] >> (CURRENT_STATE.REGS[rs2] & 0x1F);
-            } else if (funct3 == 0x6) { // OR
-                NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] | CURRENT_STATE.REGS[rs2];
-            } else if (funct3 == 0x7) { // AND
-                NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] & CURRENT_STATE.REGS[rs2];
+uint64_t hash_bytes(const void *data, size_t size, uint64_t hash) {
+    const uint8_t *p = data;
+
+    /* FNV-1a */
+    while (size--) {
+        hash = (hash ^ *p++) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/************************************************************/
+/* Open the shared file of the current program with the     */
+/* given suffix, publishing data as that file if it does    */
+/* not exist yet (unless data is NULL). -1 if it can't be   */
+/* opened or has an unexpected size.                         */
+/************************************************************/
+static int open_shared(const char *suffix, const void *data, size_t size) {
+    char path[FILENAME_MAX], tmp[FILENAME_MAX + 16];
+    const uint8_t *p = data;
+    struct stat st;
+    size_t left = size;
+    ssize_t n;
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/ozu-rv32-%016" PRIx64 "%s",
+                 SHARE_DIR, PROGRAM_HASH, suffix) >= (int)sizeof(path)) {
+        return -1;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0 && errno == ENOENT && data != NULL) {
+        /* write a private file and link it into place, so no instance sees a partial file */
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+        while (left > 0 && (n = write(fd, p, left)) > 0) {
+            p += n;
+            left -= n;
+        }
+        close(fd);
+        if (left == 0) {
+            link(tmp, path);    /* fails if another instance was faster, its file is used */
+        }
+        unlink(tmp);
+        fd = open(path, O_RDONLY);
+    }
+    if (fd >= 0 && (fstat(fd, &st) != 0 || (size_t)st.st_size != size)) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/************************************************************/
+/* Map the program image from SHARE_DIR copy-on-write at    */
+/* the start of the text segment. FALSE if it is not shared */
+/************************************************************/
+int map_shared_image(const uint8_t *image, uint32_t size) {
+    uint8_t *text = MEM_REGIONS[0].mem;
+    uint8_t *mem;
+    int fd;
+
+    if (size == 0 || (fd = open_shared(".img", image, size)) < 0) {
+        return FALSE;
+    }
+    mem = mmap(text, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED || memcmp(mem, image, size) != 0) {
+        /* hash collision or mapping error: back to private memory */
+        map_region(text, size);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/************************************************************/
+/* Privilege modes, CSRs and traps                          */
+/************************************************************/
+const char *EXCEPTION_NAMES[] = {
+    "Misaligned instruction fetch", "Instruction access fault", "Illegal instruction",
+    "Breakpoint", "Misaligned load", "Load access fault", "Misaligned store",
+    "Store access fault", "Environment call from U-mode", "", "", "Environment call from M-mode"
+};
+
+void reset_trap_state() {
+    memset(&CSR, 0, sizeof(CSR));
+    CSR.mtimecmp = UINT64_MAX;
+    PRIV = PRIV_M;
+    MTIME = 0;
+    TRAP_RAISED = FALSE;
+    update_interrupts();
+}
+
+/************************************************************/
+/* Enter the trap handler at mtvec in machine mode          */
+/************************************************************/
+void trap_enter(uint32_t cause, uint32_t tval, uint32_t epc) {
+    uint32_t base = CSR.mtvec & ~0x3;
+
+    CSR.mepc = epc;
+    CSR.mcause = cause;
+    CSR.mtval = tval;
+    CSR.mstatus = (CSR.mstatus & ~(MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP)) |
+                  ((CSR.mstatus & MSTATUS_MIE) ? MSTATUS_MPIE : 0) |
+                  (PRIV << MSTATUS_MPP_SHIFT);
+    PRIV = PRIV_M;
+    /* vectored mode only applies to interrupts */
+    if ((CSR.mtvec & 0x1) && (cause & CAUSE_INTERRUPT)) {
+        base += 4 * (cause & ~CAUSE_INTERRUPT);
+    }
+    NEXT_STATE.PC = base;
+    update_interrupts();
+}
+
+/************************************************************/
+/* Precise exception for the instruction at CURRENT_STATE.PC */
+/* Without a handler (mtvec == 0) the simulation stops:      */
+/* ecall is the program exit, anything else a fault.         */
+/************************************************************/
+void raise_exception(uint32_t cause, uint32_t tval) {
+    /* the instruction does not retire */
+    COUNTERS.exceptions[cause]++;
+    TRAP_RAISED = TRUE;
+
+    if (CSR.mtvec == 0) {
+        if (cause == CAUSE_ECALL_U || cause == CAUSE_ECALL_M) {
+            CURRENT_STATE.REGS[17] = 0x5D;
+            EXIT_STATUS = CURRENT_STATE.REGS[10] & 0xFF;
+        } else {
+            /* on stderr, stdout may be carrying JSON dumps */
+            fprintf(stderr, "%s (mtval 0x%08x) at PC 0x%08x. Simulation Stopped.\n\n",
+                    EXCEPTION_NAMES[cause], tval, CURRENT_STATE.PC);
+            EXIT_STATUS = EXIT_STATUS_FAULT;
+            NEXT_STATE = CURRENT_STATE;
+        }
+        RUN_FLAG = FALSE;
+        return;
+    }
+
+    /* drop everything the instruction did so far */
+    NEXT_STATE = CURRENT_STATE;
+    trap_enter(cause, tval, CURRENT_STATE.PC);
+}
+
+/************************************************************/
+/* Recompute mip.MTIP and the MTIME of the next interrupt    */
+/* check. Call whenever mstatus, mie, mip, mtimecmp, mtvec   */
+/* or the privilege mode change.                             */
+/************************************************************/
+void update_interrupts() {
+    int enabled = (PRIV < PRIV_M || (CSR.mstatus & MSTATUS_MIE)) && CSR.mtvec != 0;
+
+    if (MTIME >= CSR.mtimecmp) {
+        CSR.mip |= MIP_MTIP;
+    } else {
+        CSR.mip &= ~MIP_MTIP;
+    }
+
+    if (enabled && (CSR.mip & CSR.mie)) {
+        EVENT_DEADLINE = 0;
+    } else if (!(CSR.mip & MIP_MTIP)) {
+        EVENT_DEADLINE = CSR.mtimecmp;
+    } else {
+        EVENT_DEADLINE = UINT64_MAX;
+    }
+}
+
+/************************************************************/
+/* Take the highest priority pending interrupt, if any       */
+/************************************************************/
+void check_interrupts() {
+    uint32_t pending;
+
+    update_interrupts();
+    if (EVENT_DEADLINE != 0) {
+        return;
+    }
+    pending = CSR.mip & CSR.mie;
+    if (pending & MIP_MEIP) {
+        trap_enter(CAUSE_INTERRUPT | IRQ_MEI, 0, NEXT_STATE.PC);
+    } else if (pending & MIP_MSIP) {
+        trap_enter(CAUSE_INTERRUPT | IRQ_MSI, 0, NEXT_STATE.PC);
+    } else {
+        trap_enter(CAUSE_INTERRUPT | IRQ_MTI, 0, NEXT_STATE.PC);
+    }
+}
+
+/************************************************************/
+/* Drive the external interrupt line (mip.MEIP)              */
+/************************************************************/
+void set_external_interrupt(int level) {
+    if (level) {
+        CSR.mip |= MIP_MEIP;
+    } else {
+        CSR.mip &= ~MIP_MEIP;
+    }
+    update_interrupts();
+}
+
+/************************************************************/
+/* CSR access, FALSE if the CSR does not exist or the        */
+/* current privilege mode may not access it                  */
+/************************************************************/
+int csr_read(uint32_t csr, uint32_t *value) {
+    if (PRIV < ((csr >> 8) & 0x3)) {
+        return FALSE;
+    }
+    /* user counters, each gated by its mcounteren bit outside M-mode */
+    if ((csr & ~0x9F) == CSR_CYCLE) {
+        if (PRIV < PRIV_M && !(CSR.mcounteren & (1u << (csr & 0x1F)))) {
+            return FALSE;
+        }
+        if ((csr & 0x1F) != (CSR_TIME & 0x1F)) {
+            csr = CSR_MCYCLE | (csr & 0x9F);
+        }
+    }
+    /* machine counters: mcycle, minstret and mhpmcounter3.. with high words */
+    if ((csr & ~0x9F) == CSR_MCYCLE && (csr & 0x1F) != 1) {
+        uint32_t n = csr & 0x1F;
+        uint64_t count = n == 0 ? INSTRUCTION_COUNT : n == 2 ? retired_count() :
+                         n - 3 < NUM_CLASSES ? class_count(n - 3) : 0;
+        *value = (csr & 0x80) ? count >> 32 : (uint32_t)count;
+        return TRUE;
+    }
+    switch (csr) {
+        case CSR_MSTATUS:   *value = CSR.mstatus;                   break;
+        case CSR_MISA:      *value = MISA_RV32IMU;                  break;
+        case CSR_MCOUNTEREN: *value = CSR.mcounteren;               break;
+        case CSR_MIE:       *value = CSR.mie;                       break;
+        case CSR_MTVEC:     *value = CSR.mtvec;                     break;
+        case CSR_MSCRATCH:  *value = CSR.mscratch;                  break;
+        case CSR_MEPC:      *value = CSR.mepc;                      break;
+        case CSR_MCAUSE:    *value = CSR.mcause;                    break;
+        case CSR_MTVAL:     *value = CSR.mtval;                     break;
+        case CSR_MIP:       *value = CSR.mip;                       break;
+        case CSR_MTIMECMP:  *value = (uint32_t)CSR.mtimecmp;        break;
+        case CSR_MTIMECMPH: *value = CSR.mtimecmp >> 32;            break;
+        case CSR_TIME:      *value = (uint32_t)MTIME;               break;
+        case CSR_TIMEH:     *value = MTIME >> 32;                   break;
+        case CSR_MHARTID:   *value = 0;                             break;
+        default:
+            return FALSE;
+    }
+    return TRUE;
+}
+
+int csr_write(uint32_t csr, uint32_t value) {
+    /* csr[11:10] == 3 marks read-only CSRs */
+    if (PRIV < ((csr >> 8) & 0x3) || ((csr >> 10) & 0x3) == 0x3) {
+        return FALSE;
+    }
+    /* counters are read-only views of COUNTERS, writes are ignored */
+    if ((csr & ~0x9F) == CSR_MCYCLE && (csr & 0x1F) != 1) {
+        return TRUE;
+    }
+    switch (csr) {
+        case CSR_MSTATUS:
+            /* MPP only holds M or U */
+            if ((value & MSTATUS_MPP) != (PRIV_M << MSTATUS_MPP_SHIFT)) {
+                value &= ~MSTATUS_MPP;
             }
-        } else if (funct7 == 0x20) {
-            if (funct3 == 0x0) { // SUB
-                NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] - CURRENT_STATE.REGS[rs2];
-            } else if (funct3 == 0x5) { // SRA or shift right arithmetic
-                NEXT_STATE.REGS[rd] = ((int32_t)CURRENT_STATE.REGS[rs1]) >> (CURRENT_STATE.REGS[rs2] & 0x1F);
+            CSR.mstatus = value & (MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP);
+            break;
+        case CSR_MISA:                                                  break;
+        case CSR_MCOUNTEREN: CSR.mcounteren = value;                    break;
+        case CSR_MIE:       CSR.mie = value & (MIP_MSIP | MIP_MTIP | MIP_MEIP);     break;
+        case CSR_MTVEC:     CSR.mtvec = value & ~0x2;                   break;
+        case CSR_MSCRATCH:  CSR.mscratch = value;                       break;
+        case CSR_MEPC:      CSR.mepc = value & ~0x3;                    break;
+        case CSR_MCAUSE:    CSR.mcause = value;                         break;
+        case CSR_MTVAL:     CSR.mtval = value;                          break;
+        /* MTIP follows the timer and MEIP the external line, only MSIP is writable */
+        case CSR_MIP:       CSR.mip = (CSR.mip & ~MIP_MSIP) | (value & MIP_MSIP);   break;
+        case CSR_MTIMECMP:  CSR.mtimecmp = (CSR.mtimecmp & 0xFFFFFFFF00000000ull) | value;          break;
+        case CSR_MTIMECMPH: CSR.mtimecmp = (CSR.mtimecmp & 0xFFFFFFFFull) | ((uint64_t)value << 32); break;
+        default:
+            return FALSE;
+    }
+    update_interrupts();
+    return TRUE;
+}
+
+/************************************************************/
+/* Instruction decoder                                      */
+/************************************************************/
+
+#define OP_INFO_ENTRY(op, name, mask, match, fmt) { name, mask, match, fmt },
+const op_info_t OP_INFO[NUM_OPS] = {
+    RV32IM_OPS(OP_INFO_ENTRY)
+};
+#undef OP_INFO_ENTRY
+
+/* decode key: opcode[6:2], funct3, funct7 bits 30 and 25, and ins[22:20] (SYSTEM ops) */
+#define DECODE_KEY_BITS 13
+#define DECODE_KEY(ins) ((((ins) >> 2) & 0x1F) << 8 | (((ins) >> 12) & 0x7) << 5 | \
+                         (((ins) >> 30) & 0x1) << 4 | (((ins) >> 25) & 0x1) << 3 | \
+                         (((ins) >> 20) & 0x7))
+
+uint8_t DECODE_TABLE[1 << DECODE_KEY_BITS];
+decode_cache_entry_t DECODE_CACHE[DECODE_CACHE_SIZE];
+
+/* sign extended immediates, without branches */
+static inline int32_t imm_i(uint32_t ins) {
+    return (int32_t)ins >> 20;
+}
+
+static inline int32_t imm_s(uint32_t ins) {
+#ifdef __BMI2__
+    return ((int32_t)(_pext_u32(ins, 0xFE000F80) << 20)) >> 20;
+#else
+    return (((int32_t)ins >> 20) & ~0x1F) | ((ins >> 7) & 0x1F);
+#endif
+}
+
+static inline int32_t imm_b(uint32_t ins) {
+#ifdef __BMI2__
+    /* same bits as the S-type immediate, with imm[11] moved out of bit 0 */
+    uint32_t bits = _pext_u32(ins, 0xFE000F80);
+    return (((int32_t)(bits << 20) >> 19) & ~0xFFF) | (bits & 0x7FE) | ((bits & 0x1) << 11);
+#else
+    return (((int32_t)ins >> 19) & ~0xFFF) | ((ins << 4) & 0x800) |
+           ((ins >> 20) & 0x7E0) | ((ins >> 7) & 0x1E);
+#endif
+}
+
+static inline int32_t imm_j(uint32_t ins) {
+    return (((int32_t)ins >> 11) & ~0xFFFFF) | (ins & 0xFF000) |
+           ((ins >> 9) & 0x800) | ((ins >> 20) & 0x7FE);
+}
+
+/************************************************************/
+/* Fill the decode table from the mask/match list           */
+/************************************************************/
+void init_decoder() {
+    uint32_t op, bits, ins;
+
+    memset(DECODE_TABLE, OP_ILLEGAL, sizeof(DECODE_TABLE));
+    for (op = OP_ILLEGAL + 1; op < NUM_OPS; op++) {
+        /* try every value of the key bits the instruction leaves free */
+        for (bits = 0; bits < 256; bits++) {
+            ins = OP_INFO[op].match | ((bits & 0x7) << 12) | ((bits >> 3) & 0x1) << 30 |
+                  ((bits >> 4) & 0x1) << 25 | ((bits >> 5) & 0x7) << 20;
+            if ((ins & OP_INFO[op].mask) == OP_INFO[op].match) {
+                DECODE_TABLE[DECODE_KEY(ins)] = op;
             }
-        } else if (funct7 == 0x01) {
-            if (funct3 == 0x0) { // MUL
-                NEXT_STATE.REGS[rd] = (int32_t)CURRENT_STATE.REGS[rs1] * (int32_t)CURRENT_STATE.REGS[rs2];
-            } else if (funct3 == 0x4) { // DIV
-                    NEXT_STATE.REGS[rd] = (int32_t)CURRENT_STATE.REGS[rs1] / (int32_t)CURRENT_STATE.REGS[rs2];
-            } else if (funct3 == 0x5) { // DIVU
-                    NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] / CURRENT_STATE.REGS[rs2];
+        }
+    }
+    flush_decode_cache();
+}
+
+/************************************************************/
+/* Drop all / one cached decoded instruction(s)             */
+/************************************************************/
+void flush_decode_cache() {
+    int i;
+    for (i = 0; i < DECODE_CACHE_SIZE; i++) {
+        DECODE_CACHE[i].pc = DECODE_CACHE_INVALID;
+    }
+}
+
+void invalidate_decode_cache(uint32_t address) {
+    decode_cache_entry_t *e = &DECODE_CACHE[(address >> 2) & (DECODE_CACHE_SIZE - 1)];
+    if (e->pc == (address & ~0x3)) {
+        e->pc = DECODE_CACHE_INVALID;
+    }
+}
+
+/************************************************************/
+/* Decode an instruction word into its compact form         */
+/************************************************************/
+void decode_instruction(uint32_t ins, decoded_ins_t *d) {
+    uint32_t op = DECODE_TABLE[DECODE_KEY(ins)];
+    int32_t imm[NUM_FMTS];
+
+    /* bits outside of the key must match too, otherwise the instruction is illegal */
+    op &= -(uint32_t)((ins & OP_INFO[op].mask) == OP_INFO[op].match);
+
+    imm[FMT_NONE] = imm[FMT_R] = imm[FMT_SYS] = 0;
+    imm[FMT_RAW] = ins;
+    imm[FMT_CSR] = imm[FMT_CSRI] = ins >> 20;
+    imm[FMT_I] = imm[FMT_LOAD] = imm[FMT_JALR] = imm_i(ins);
+    imm[FMT_SHIFT] = (ins >> 20) & 0x1F;
+    imm[FMT_S] = imm_s(ins);
+    imm[FMT_B] = imm_b(ins);
+    imm[FMT_U] = ins & 0xFFFFF000;
+    imm[FMT_J] = imm_j(ins);
+
+    d->op = op;
+    d->rd = (ins >> 7) & 0x1F;
+    d->rs1 = (ins >> 15) & 0x1F;
+    d->rs2 = (ins >> 20) & 0x1F;
+    d->imm = imm[OP_INFO[op].fmt];
+}
+
+/************************************************************/
+/* Decode every word of the program image once. If the      */
+/* image is shared the result is shared through SHARE_DIR   */
+/* as well, by all instances running the same program.      */
+/************************************************************/
+static void *PREDECODED_MAP;        /* allocation or mapping holding PREDECODED */
+static size_t PREDECODED_MAP_SIZE;  /* 0 if allocated */
+
+/* map the shared predecoded program, publishing data if there is none yet; */
+/* NULL unless its header is the expected one                               */
+static void *map_predecoded(const predecoded_header_t *expected, const void *data, size_t size) {
+    void *map;
+    int fd;
+
+    if ((fd = open_shared(".dec", data, size)) < 0) {
+        return NULL;
+    }
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    if (memcmp(map, expected, sizeof(*expected)) != 0) {
+        munmap(map, size);
+        return NULL;
+    }
+    return map;
+}
+
+void load_predecoded(const uint8_t *image, uint32_t words, int shared) {
+    size_t size = sizeof(predecoded_header_t) + (size_t)words * sizeof(decoded_ins_t);
+    predecoded_header_t expected = {
+        PREDECODED_MAGIC, sizeof(decoded_ins_t), HASH_SEED, PROGRAM_HASH, words, 0
+    };
+    predecoded_header_t *h;
+    decoded_ins_t *d;
+    void *map;
+    uint32_t i;
+
+    if (PREDECODED_MAP_SIZE) {
+        munmap(PREDECODED_MAP, PREDECODED_MAP_SIZE);
+    } else {
+        free(PREDECODED_MAP);
+    }
+    PREDECODED_WORDS = words;
+
+    for (i = 0; i < NUM_OPS; i++) {
+        expected.ops_hash = hash_bytes(&OP_INFO[i].mask, sizeof(OP_INFO[i].mask), expected.ops_hash);
+        expected.ops_hash = hash_bytes(&OP_INFO[i].match, sizeof(OP_INFO[i].match), expected.ops_hash);
+        expected.ops_hash = hash_bytes(&OP_INFO[i].fmt, sizeof(OP_INFO[i].fmt), expected.ops_hash);
+    }
+
+    /* the shared image was compared byte for byte, a file of this build */
+    /* for the same image holds the same entries: the header is enough  */
+    if (shared && (map = map_predecoded(&expected, NULL, size)) != NULL) {
+        PREDECODED_MAP = map;
+        PREDECODED_MAP_SIZE = size;
+        PREDECODED = (decoded_ins_t *)((predecoded_header_t *)map + 1);
+        return;
+    }
+
+    h = calloc(1, size);
+    d = (decoded_ins_t *)(h + 1);
+    *h = expected;
+    for (i = 0; i < words; i++) {
+        decode_instruction(host_load(image + i * 4, 4), &d[i]);
+    }
+    PREDECODED_MAP = h;
+    PREDECODED_MAP_SIZE = 0;
+    PREDECODED = d;
+
+    /* no usable file yet: publish this one, or use the one of a faster instance */
+    if (shared && (map = map_predecoded(&expected, h, size)) != NULL) {
+        free(h);
+        PREDECODED_MAP = map;
+        PREDECODED_MAP_SIZE = size;
+        PREDECODED = (decoded_ins_t *)((predecoded_header_t *)map + 1);
+    }
+}
+
+/************************************************************/
+/* Performance counters                                     */
+/************************************************************/
+#define CLASS_NAME(cls, name) name,
+const char *CLASS_NAMES[NUM_CLASSES] = {
+    INS_CLASSES(CLASS_NAME)
+};
+#undef CLASS_NAME
+
+stats_format_t STATS_ON_EXIT = STATS_NONE;
+const char *STATS_FILE = NULL;
+
+void reset_counters() {
+    memset(&COUNTERS, 0, sizeof(COUNTERS));
+}
+
+/* class of an op; branches are split into taken/not taken by class_count() */
+static int op_class(uint32_t op) {
+    switch (OP_INFO[op].fmt) {
+        case FMT_LOAD:  return CLS_LOAD;
+        case FMT_S:     return CLS_STORE;
+        case FMT_B:     return CLS_BRANCH_NOT_TAKEN;
+        case FMT_J:
+        case FMT_JALR:  return CLS_JUMP;
+        case FMT_NONE:
+        case FMT_SYS:
+        case FMT_CSR:
+        case FMT_CSRI:  return CLS_SYSTEM;
+        case FMT_RAW:   return -1;  /* illegal, never retires */
+        default:        return (op >= OP_MUL && op <= OP_REMU) ? CLS_MULDIV : CLS_ALU;
+    }
+}
+
+/************************************************************/
+/* Retired instructions, all and of one class               */
+/************************************************************/
+uint64_t retired_count() {
+    uint64_t count = INSTRUCTION_COUNT;
+    int i;
+
+    for (i = 0; i < NUM_CAUSES; i++) {
+        count -= COUNTERS.exceptions[i];
+    }
+    return count;
+}
+
+uint64_t class_count(int cls) {
+    uint64_t count = 0;
+    uint32_t op;
+
+    if (cls == CLS_BRANCH_TAKEN) {
+        return COUNTERS.branches_taken;
+    }
+    for (op = 0; op < NUM_OPS; op++) {
+        if (op_class(op) == cls) {
+            count += COUNTERS.ops[op];
+        }
+    }
+    if (cls == CLS_BRANCH_NOT_TAKEN) {
+        count -= COUNTERS.branches_taken;
+    }
+    return count;
+}
+
+/************************************************************/
+/* Host memory backing guest memory: the pages touched so   */
+/* far, including pages of a shared program image           */
+/************************************************************/
+static uint64_t memory_resident_bytes() {
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t bytes = 0;
+    unsigned char *vec;
+    size_t size, pages, j;
+    int i;
+
+    for (i = 0; i < NUM_MEM_REGION; i++) {
+        size = (size_t)MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
+        pages = (size + page - 1) / page;
+        vec = malloc(pages);
+        if (vec != NULL && mincore(MEM_REGIONS[i].mem, size, vec) == 0) {
+            for (j = 0; j < pages; j++) {
+                bytes += (vec[j] & 1) * page;
             }
         }
+        free(vec);
     }
-    
-    else if (opcode == 0x13) {// I-type instructions
-        rd = (current_ins >> 7) & 0x1F;
-        funct3 = (current_ins >> 12) & 0x07;
-        rs1 = (current_ins >> 15) & 0x1F;
-        imm = (current_ins >> 20); 
-        imm_sext = ((int32_t)current_ins) >> 20; 
-
-        if (funct3 == 0x0) { // ADDI
-            NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] + imm_sext;
-        } else if (funct3 == 0x2) { // SLTI
-            NEXT_STATE.REGS[rd] = ((int32_t)CURRENT_STATE.REGS[rs1] < imm_sext) ? 1 : 0;
-        } else if (funct3 == 0x4) { // XORI
-            NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] ^ imm_sext;
-        } else if (funct3 == 0x6) { // ORI
-            NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] | imm_sext;
-        } else if (funct3 == 0x7) { // ANDI
-            NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] & imm_sext;
-        } else if (funct3 == 0x1) { // SLLI
-            shamt = imm & 0x1F;
-            NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] << shamt;
-        } else if (funct3 == 0x5) {
-            shamt = imm & 0x1F;
-            funct7 = (current_ins >> 25) & 0x7F;
-            if (funct7 == 0x00) { // SRLI 
-                NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs1] >> shamt;
-            } else if (funct7 == 0x20) { // SRAI
-                NEXT_STATE.REGS[rd] = ((int32_t)CURRENT_STATE.REGS[rs1]) >> shamt;
+    return bytes;
+}
+
+/************************************************************/
+/* Export all counters as JSON or Prometheus text           */
+/************************************************************/
+void print_stats(FILE *fp, stats_format_t format) {
+    uint64_t memory = memory_resident_bytes();
+    double seconds = COUNTERS.host_ns / 1e9;
+    double mips = seconds > 0 ? INSTRUCTION_COUNT / seconds / 1e6 : 0;
+    const char *sep = "";
+    int i;
+
+    if (format == STATS_JSON) {
+        fprintf(fp, "{\"instructions\":%" PRIu64 ",\"retired\":%" PRIu64 ",\"classes\":{",
+                INSTRUCTION_COUNT, retired_count());
+        for (i = 0; i < NUM_CLASSES; i++) {
+            fprintf(fp, "%s\"%s\":%" PRIu64, i ? "," : "", CLASS_NAMES[i], class_count(i));
+        }
+        /* exceptions by mcause */
+        fprintf(fp, "},\"exceptions\":{");
+        for (i = 0; i < NUM_CAUSES; i++) {
+            if (EXCEPTION_NAMES[i][0] != '\0') {
+                fprintf(fp, "%s\"%d\":%" PRIu64, sep, i, COUNTERS.exceptions[i]);
+                sep = ",";
             }
         }
+        fprintf(fp, "},\"decode_cache_misses\":%" PRIu64 ",\"misaligned_accesses\":%" PRIu64
+                ",\"unmapped_accesses\":%" PRIu64 ",\"memory_resident_bytes\":%" PRIu64
+                ",\"host_seconds\":%.6f,\"mips\":%.3f}\n",
+                COUNTERS.decode_misses, COUNTERS.misaligned, COUNTERS.unmapped, memory, seconds, mips);
+        return;
     }
 
-    else if (opcode == 0x03) {// I-type load instructions
-        rd = (current_ins >> 7) & 0x1F;
-        funct3 = (current_ins >> 12) & 0x07;
-        rs1 = (current_ins >> 15) & 0x1F;
-        imm_sext = ((int32_t)current_ins) >> 20; // sign extend immediate
-        uint32_t addr = CURRENT_STATE.REGS[rs1] + imm_sext;
-        uint32_t data = mem_read_32(addr); // Read data once
-
-        if (funct3 == 0x0) { // LB
-            NEXT_STATE.REGS[rd] = (int8_t)data;
-        } else if (funct3 == 0x1) { // LH
-            NEXT_STATE.REGS[rd] = (int16_t)data;
-        } else if (funct3 == 0x2) { // LW
-            NEXT_STATE.REGS[rd] = (int32_t)data;
-        } else if (funct3 == 0x4) { // LBU
-            NEXT_STATE.REGS[rd] = (uint8_t)data;
-        } else if (funct3 == 0x5) { // LHU
-            NEXT_STATE.REGS[rd] = (uint16_t)data;
-        }    
-    }
-
-    else if (opcode == 0x23) {// S-type store instructions
-        funct3 = (current_ins >> 12) & 0x07;
-        rs1 = (current_ins >> 15) & 0x1F;
-        rs2 = (current_ins >> 20) & 0x1F;
-
-        uint32_t imm = ((current_ins >> 7) & 0x1F) | (((current_ins >> 25) & 0x7F) << 5); 
-        int32_t imm_sext = ((int32_t)(imm << 20)) >> 20; 
-        uint32_t addr = CURRENT_STATE.REGS[rs1] + imm_sext; 
-        uint32_t data = CURRENT_STATE.REGS[rs2]; 
-
-        if (funct3 == 0x0) { // SB: store byte
-            uint32_t byte_offset = addr % 4; 
-            uint32_t word = mem_read_32(addr & ~0x3); 
-            word = (word & ~(0xFF << (byte_offset * 8))) | ((data & 0xFF) << (byte_offset * 8)); 
-            mem_write_32(addr & ~0x3, word); 
-        } else if (funct3 == 0x1) { // SH: store half-word
-            uint32_t byte_offset = addr % 4;
-            uint32_t word = mem_read_32(addr & ~0x3); 
-            word = (word & ~(0xFFFF << (byte_offset * 8))) | ((data & 0xFFFF) << (byte_offset * 8));
-            mem_write_32(addr & ~0x3, word);
-        } else if (funct3 == 0x2) { // SW: store word
-            mem_write_32(addr, data);
+    fprintf(fp, "# HELP ozu_rv32_instructions_total Instructions executed.\n");
+    fprintf(fp, "# TYPE ozu_rv32_instructions_total counter\n");
+    fprintf(fp, "ozu_rv32_instructions_total %" PRIu64 "\n", INSTRUCTION_COUNT);
+    fprintf(fp, "# HELP ozu_rv32_retired_instructions_total Instructions retired, without those that trapped.\n");
+    fprintf(fp, "# TYPE ozu_rv32_retired_instructions_total counter\n");
+    fprintf(fp, "ozu_rv32_retired_instructions_total %" PRIu64 "\n", retired_count());
+    fprintf(fp, "# HELP ozu_rv32_class_instructions_total Instructions retired by class.\n");
+    fprintf(fp, "# TYPE ozu_rv32_class_instructions_total counter\n");
+    for (i = 0; i < NUM_CLASSES; i++) {
+        fprintf(fp, "ozu_rv32_class_instructions_total{class=\"%s\"} %" PRIu64 "\n",
+                CLASS_NAMES[i], class_count(i));
+    }
+    fprintf(fp, "# HELP ozu_rv32_exceptions_total Exceptions taken, by mcause.\n");
+    fprintf(fp, "# TYPE ozu_rv32_exceptions_total counter\n");
+    for (i = 0; i < NUM_CAUSES; i++) {
+        if (EXCEPTION_NAMES[i][0] != '\0') {
+            fprintf(fp, "ozu_rv32_exceptions_total{cause=\"%d\"} %" PRIu64 "\n", i, COUNTERS.exceptions[i]);
         }
     }
-    
-    else if (opcode == 0x63) { // SB-type branch instructions
-        funct3 = (current_ins >> 12) & 0x7;
-        rs1 = (current_ins >> 15) & 0x1F;
-        rs2 = (current_ins >> 20) & 0x1F;
+    fprintf(fp, "# TYPE ozu_rv32_decode_cache_misses_total counter\n");
+    fprintf(fp, "ozu_rv32_decode_cache_misses_total %" PRIu64 "\n", COUNTERS.decode_misses);
+    fprintf(fp, "# TYPE ozu_rv32_misaligned_accesses_total counter\n");
+    fprintf(fp, "ozu_rv32_misaligned_accesses_total %" PRIu64 "\n", COUNTERS.misaligned);
+    fprintf(fp, "# TYPE ozu_rv32_unmapped_accesses_total counter\n");
+    fprintf(fp, "ozu_rv32_unmapped_accesses_total %" PRIu64 "\n", COUNTERS.unmapped);
+    fprintf(fp, "# HELP ozu_rv32_memory_resident_bytes Host memory backing the guest memory pages touched so far.\n");
+    fprintf(fp, "# TYPE ozu_rv32_memory_resident_bytes gauge\n");
+    fprintf(fp, "ozu_rv32_memory_resident_bytes %" PRIu64 "\n", memory);
+    fprintf(fp, "# TYPE ozu_rv32_host_seconds_total counter\n");
+    fprintf(fp, "ozu_rv32_host_seconds_total %.6f\n", seconds);
+    fprintf(fp, "# TYPE ozu_rv32_mips gauge\n");
+    fprintf(fp, "ozu_rv32_mips %.3f\n", mips);
+}
 
-        int32_t imm_12 = ((current_ins >> 31) & 0x1) << 12; 
-        int32_t imm_11 = ((current_ins >> 7)  & 0x1) << 11; 
-        int32_t imm_10_5 = ((current_ins >> 25) & 0x3F) << 5; 
-        int32_t imm_4_1 = ((current_ins >> 8)  & 0xF)  << 1; 
+/************************************************************/
+/* atexit() hook for --stats                                */
+/************************************************************/
+void export_stats_on_exit() {
+    FILE *fp = stdout;
 
-        int32_t imm = imm_12 + imm_11 + imm_10_5 + imm_4_1; 
+    if (STATS_FILE != NULL) {
+        fp = fopen(STATS_FILE, "w");
+        if (fp == NULL) {
+            printf("Error: Can't open stats file %s\n", STATS_FILE);
+            return;
+        }
+    }
+    print_stats(fp, STATS_ON_EXIT);
+    if (fp != stdout) {
+        fclose(fp);
+    }
+}
 
-        imm = (imm << 19) >> 19; 
+/************************************************************/
+/* decode and execute instruction                           */ 
+/************************************************************/
+void handle_instruction()
+{
+    decode_cache_entry_t *e = &DECODE_CACHE[(CURRENT_STATE.PC >> 2) & (DECODE_CACHE_SIZE - 1)];
+    uint32_t index;
+
+    if (e->pc != CURRENT_STATE.PC) {
+        /* jumps and branches trap on misaligned targets themselves, this is */
+        /* a safety net; misaligned PCs are never cached, so hits skip it    */
+        if (CURRENT_STATE.PC & 0x3) {
+            raise_exception(CAUSE_FETCH_MISALIGNED, CURRENT_STATE.PC);
+            return;
+        }
+        index = (CURRENT_STATE.PC - MEM_TEXT_BEGIN) >> 2;
+        if (index < PREDECODED_WORDS) {
+            e->d = PREDECODED[index];
+        } else {
+            decode_instruction(mem_read_32(CURRENT_STATE.PC), &e->d);
+        }
+        e->pc = CURRENT_STATE.PC;
+        COUNTERS.decode_misses++;
+    }
+    NEXT_STATE.PC = CURRENT_STATE.PC + 4;
+    execute_instruction(&e->d);
+    NEXT_STATE.REGS[0] = 0;
+    /* only retired instructions count */
+    COUNTERS.ops[e->d.op] += !TRAP_RAISED;
+}
 
-        uint32_t target_pc = CURRENT_STATE.PC + imm;
+/************************************************************/
+/* Execute a decoded instruction                            */
+/************************************************************/
+void execute_instruction(const decoded_ins_t *d)
+{
+    uint32_t rs1 = CURRENT_STATE.REGS[d->rs1];
+    uint32_t rs2 = CURRENT_STATE.REGS[d->rs2];
+    uint32_t imm = d->imm;
+    uint32_t *rd = &NEXT_STATE.REGS[d->rd];
+    uint32_t addr = rs1 + imm;
+    uint32_t pc = CURRENT_STATE.PC;
+    uint32_t value, target, old = 0;
+    int taken;
 
-        if (funct3 == 0x0) { // BEQ
-            if (CURRENT_STATE.REGS[rs1] == CURRENT_STATE.REGS[rs2]) {
-                NEXT_STATE.PC = target_pc;
+    switch (d->op) {
+        case OP_LUI:    *rd = imm;                                          break;
+        case OP_AUIPC:  *rd = pc + imm;                                     break;
+        case OP_JAL:    target = pc + imm;                                  goto jump;
+        case OP_JALR:   target = addr & ~1;                                 goto jump;
+        jump:
+            /* a misaligned target traps on the jump itself, rd is left alone */
+            if (target & 0x3) {
+                raise_exception(CAUSE_FETCH_MISALIGNED, target);
+                goto block_end;
             }
-        } else if (funct3 == 0x1) { // BNE
-            if (CURRENT_STATE.REGS[rs1] != CURRENT_STATE.REGS[rs2]) {
-                NEXT_STATE.PC = target_pc;
+            *rd = pc + 4;
+            NEXT_STATE.PC = target;
+            goto block_end;
+
+        case OP_BEQ:    taken = rs1 == rs2;                                 goto branch;
+        case OP_BNE:    taken = rs1 != rs2;                                 goto branch;
+        case OP_BLT:    taken = (int32_t)rs1 < (int32_t)rs2;                goto branch;
+        case OP_BGE:    taken = (int32_t)rs1 >= (int32_t)rs2;               goto branch;
+        case OP_BLTU:   taken = rs1 < rs2;                                  goto branch;
+        case OP_BGEU:   taken = rs1 >= rs2;                                 goto branch;
+        branch:
+            if (taken) {
+                if ((pc + imm) & 0x3) {
+                    raise_exception(CAUSE_FETCH_MISALIGNED, pc + imm);
+                    goto block_end;
+                }
+                NEXT_STATE.PC = pc + imm;
+                COUNTERS.branches_taken++;
             }
-        } else if (funct3 == 0x4) { // BLT
-            if ((int32_t)CURRENT_STATE.REGS[rs1] < (int32_t)CURRENT_STATE.REGS[rs2]) {
-                NEXT_STATE.PC = target_pc;
+            goto block_end;
+
+        case OP_LB:     value = (int8_t)mem_read_8(addr);                   goto load;
+        case OP_LH:     value = (int16_t)mem_read_16(addr);                 goto load;
+        case OP_LW:     value = mem_read_32(addr);                          goto load;
+        case OP_LBU:    value = mem_read_8(addr);                           goto load;
+        case OP_LHU:    value = mem_read_16(addr);                          goto load;
+        load:
+            /* a trapped load must not write rd into the restored state */
+            if (!TRAP_RAISED) {
+                *rd = value;
             }
-        } else if (funct3 == 0x5) { // BGE
-            if ((int32_t)CURRENT_STATE.REGS[rs1] >= (int32_t)CURRENT_STATE.REGS[rs2]) {
-                NEXT_STATE.PC = target_pc;
+            break;
+
+        case OP_SB:     mem_write_8(addr, rs2);                             break;
+        case OP_SH:     mem_write_16(addr, rs2);                            break;
+        case OP_SW:     mem_write_32(addr, rs2);                            break;
+
+        case OP_ADDI:   *rd = rs1 + imm;                                    break;
+        case OP_SLTI:   *rd = (int32_t)rs1 < (int32_t)imm;                  break;
+        case OP_SLTIU:  *rd = rs1 < imm;                                    break;
+        case OP_XORI:   *rd = rs1 ^ imm;                                    break;
+        case OP_ORI:    *rd = rs1 | imm;                                    break;
+        case OP_ANDI:   *rd = rs1 & imm;                                    break;
+        case OP_SLLI:   *rd = rs1 << imm;                                   break;
+        case OP_SRLI:   *rd = rs1 >> imm;                                   break;
+        case OP_SRAI:   *rd = (int32_t)rs1 >> imm;                          break;
+
+        case OP_ADD:    *rd = rs1 + rs2;                                    break;
+        case OP_SUB:    *rd = rs1 - rs2;                                    break;
+        case OP_SLL:    *rd = rs1 << (rs2 & 0x1F);                          break;
+        case OP_SLT:    *rd = (int32_t)rs1 < (int32_t)rs2;                  break;
+        case OP_SLTU:   *rd = rs1 < rs2;                                    break;
+        case OP_XOR:    *rd = rs1 ^ rs2;                                    break;
+        case OP_SRL:    *rd = rs1 >> (rs2 & 0x1F);                          break;
+        case OP_SRA:    *rd = (int32_t)rs1 >> (rs2 & 0x1F);                 break;
+        case OP_OR:     *rd = rs1 | rs2;                                    break;
+        case OP_AND:    *rd = rs1 & rs2;                                    break;
+
+        case OP_MUL:    *rd = rs1 * rs2;                                                break;
+        case OP_MULH:   *rd = ((int64_t)(int32_t)rs1 * (int64_t)(int32_t)rs2) >> 32;    break;
+        case OP_MULHSU: *rd = ((int64_t)(int32_t)rs1 * (int64_t)rs2) >> 32;             break;
+        case OP_MULHU:  *rd = ((uint64_t)rs1 * (uint64_t)rs2) >> 32;                    break;
+        /* division by zero and overflow give the results defined by the M extension */
+        case OP_DIV:
+            if (rs2 == 0) *rd = 0xFFFFFFFF;
+            else if (rs1 == 0x80000000 && rs2 == 0xFFFFFFFF) *rd = rs1;
+            else *rd = (int32_t)rs1 / (int32_t)rs2;
+            break;
+        case OP_DIVU:   *rd = rs2 ? rs1 / rs2 : 0xFFFFFFFF;                 break;
+        case OP_REM:
+            if (rs2 == 0) *rd = rs1;
+            else if (rs1 == 0x80000000 && rs2 == 0xFFFFFFFF) *rd = 0;
+            else *rd = (int32_t)rs1 % (int32_t)rs2;
+            break;
+        case OP_REMU:   *rd = rs2 ? rs1 % rs2 : rs1;                        break;
+
+        case OP_FENCE:                                                      break;
+        case OP_FENCE_I:
+            /* the guest changed its code: drop everything decoded so far */
+            flush_decode_cache();
+            PREDECODED_WORDS = 0;
+            break;
+        case OP_ECALL:
+            raise_exception(PRIV == PRIV_U ? CAUSE_ECALL_U : CAUSE_ECALL_M, 0);
+            break;
+        case OP_EBREAK:
+            raise_exception(CAUSE_BREAKPOINT, pc);
+            break;
+        case OP_MRET:
+            if (PRIV < PRIV_M) {
+                goto illegal;
             }
-        } else if (funct3 == 0x6) { // BLTU
-            if (CURRENT_STATE.REGS[rs1] < CURRENT_STATE.REGS[rs2]) {
-                NEXT_STATE.PC = target_pc;
+            PRIV = (CSR.mstatus & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT;
+            CSR.mstatus = (CSR.mstatus & ~(MSTATUS_MIE | MSTATUS_MPP)) | MSTATUS_MPIE |
+                          ((CSR.mstatus & MSTATUS_MPIE) ? MSTATUS_MIE : 0);
+            NEXT_STATE.PC = CSR.mepc;
+            update_interrupts();
+            goto block_end;
+        case OP_WFI:
+            /* nothing else can happen while waiting: skip ahead to the timer */
+            if ((CSR.mie & MIP_MTIP) && MTIME < CSR.mtimecmp) {
+                MTIME = CSR.mtimecmp;
             }
-        } else if (funct3 == 0x7) { // BGEU
-            if (CURRENT_STATE.REGS[rs1] >= CURRENT_STATE.REGS[rs2]) {
-                NEXT_STATE.PC = target_pc;
+            update_interrupts();
+            goto block_end;
+
+        /* CSRRS/CSRRC with rs1 = x0 (or uimm = 0) only read */
+        case OP_CSRRW:  value = rs1;            goto csr_write;
+        case OP_CSRRS:  value = rs1;            goto csr_set;
+        case OP_CSRRC:  value = rs1;            goto csr_clear;
+        case OP_CSRRWI: value = d->rs1;         goto csr_write;
+        case OP_CSRRSI: value = d->rs1;         goto csr_set;
+        case OP_CSRRCI: value = d->rs1;         goto csr_clear;
+        csr_write:
+            if ((d->rd != 0 && !csr_read(imm, &old)) || !csr_write(imm, value)) {
+                goto illegal;
             }
-        }
-    }
-    
-    else if (opcode == 0x6F) { // JAL
-        uint32_t rd = (current_ins >> 7) & 0x1F;
-        int32_t imm = 0;
-        int32_t imm20 = ((current_ins >> 31) & 0x1) << 20;   
-        int32_t imm10_1 = ((current_ins >> 21) & 0x3FF) << 1; 
-        int32_t imm11 = ((current_ins >> 20) & 0x1) << 11;    
-        int32_t imm19_12 = ((current_ins >> 12) & 0xFF) << 12; 
-        imm = imm20 + imm19_12 + imm11 + imm10_1;
-        imm = (imm << 11) >> 11; 
-        NEXT_STATE.REGS[rd] = CURRENT_STATE.PC + 4;
-        NEXT_STATE.PC = CURRENT_STATE.PC + imm;
-    }
-
-    else if (opcode == 0x67) { // JALR
-        uint32_t rd = (current_ins >> 7) & 0x1F;
-        uint32_t funct3 = (current_ins >> 12) & 0x7;
-        uint32_t rs1 = (current_ins >> 15) & 0x1F;
-        int32_t imm = (int32_t)current_ins >> 20; // Bits [31:20]
-        if (funct3 == 0x0) {
-            uint32_t temp = CURRENT_STATE.PC + 4;
-            NEXT_STATE.PC = (CURRENT_STATE.REGS[rs1] + imm) & ~1; 
-            NEXT_STATE.REGS[rd] = temp;
-        }
-    }
+            *rd = old;
+            goto block_end;
+        csr_set:
+            if (!csr_read(imm, &old) || (d->rs1 != 0 && !csr_write(imm, old | value))) {
+                goto illegal;
+            }
+            *rd = old;
+            goto block_end;
+        csr_clear:
+            if (!csr_read(imm, &old) || (d->rs1 != 0 && !csr_write(imm, old & ~value))) {
+                goto illegal;
+            }
+            *rd = old;
+            goto block_end;
 
-    else if (opcode == 0x37) { // LUI
-        uint32_t rd = (current_ins >> 7) & 0x1F;
-        int32_t imm = current_ins & 0xFFFFF000; //lower 12 bits are zeros
-        NEXT_STATE.REGS[rd] = imm;
+        default:
+        illegal:
+            raise_exception(CAUSE_ILLEGAL_INS, mem_peek_32(pc));
+            break;
     }
+    return;
 
-    else if (opcode == 0x17) { // AUIPC
-        uint32_t rd = (current_ins >> 7) & 0x1F;
-        int32_t imm = current_ins & 0xFFFFF000; //makes lower 12 bits zeros
-        NEXT_STATE.REGS[rd] = CURRENT_STATE.PC + imm;
+block_end:
+    /* interrupts are only looked at on block boundaries: one compare against the next event */
+    if (MTIME >= EVENT_DEADLINE) {
+        check_interrupts();
     }
-
-    else if (opcode == 0x73) { // ECALL
-        CURRENT_STATE.REGS[17] = 0x5D;
-        RUN_FLAG = FALSE;
-    }  
-    NEXT_STATE.REGS[0] = 0;
-
-    /*YOU NEED TO IMPLEMENT THIS*/
-    /* execute one instruction at a time. Use/update CURRENT_STATE and and NEXT_STATE, as necessary.*/
 }
 
 
@@ -503,6 +1503,8 @@ void handle_instruction()
 /************************************************************/
 void initialize() { 
     init_memory();
+    init_decoder();
+    reset_trap_state();
     CURRENT_STATE.PC = MEM_TEXT_BEGIN;
     NEXT_STATE = CURRENT_STATE;
     RUN_FLAG = TRUE;
@@ -526,182 +1528,52 @@ void print_program(){
 /* Print the instruction at given memory address (in RISC-V assembly format)  */
 /******************************************************************************/
 void print_instruction(uint32_t addr){
-    /*YOU NEED TO IMPLEMENT THIS FUNCTION*/
-    uint32_t current_ins = mem_read_32(addr);
-    uint32_t opcode = current_ins & 0x7F;
-    uint32_t rd, funct3, rs1, rs2, funct7, imm, shamt;
-    int32_t imm_sext;
+    uint32_t current_ins = mem_peek_32(addr);
+    decoded_ins_t d;
+    const char *name;
 
-    
-    if (opcode == 0x33) {// R-type instructions
-        rd = (current_ins >> 7) & 0x1F;
-        funct3 = (current_ins >> 12) & 0x07;
-        rs1 = (current_ins >> 15) & 0x1F;
-        rs2 = (current_ins >> 20) & 0x1F;
-        funct7 = (current_ins >> 25) & 0x7F;
-
-        if (funct7 == 0x00) {
-            if (funct3 == 0x0) {
-                printf("add x%d, x%d, x%d\n", rd, rs1, rs2);
-            } else if (funct3 == 0x1) {
-                printf("sll x%d, x%d, x%d\n", rd, rs1, rs2);
-            } else if (funct3 == 0x2) {
-                printf("slt x%d, x%d, x%d\n", rd, rs1, rs2);
-            } else if (funct3 == 0x4) {
-                printf("xor x%d, x%d, x%d\n", rd, rs1, rs2);
-            } else if (funct3 == 0x5) {
-                printf("srl x%d, x%d, x%d\n", rd, rs1, rs2);
-            } else if (funct3 == 0x6) {
-                printf("or x%d, x%d, x%d\n", rd, rs1, rs2);
-            } else if (funct3 == 0x7) {
-                printf("and x%d, x%d, x%d\n", rd, rs1, rs2);
-            }
-        } else if (funct7 == 0x20) {
-            if (funct3 == 0x0) {
-                printf("sub x%d, x%d, x%d\n", rd, rs1, rs2);
-            } else if (funct3 == 0x5) {
-                printf("sra x%d, x%d, x%d\n", rd, rs1, rs2);
-            }
-        } else if (funct7 == 0x01) {
-            if (funct3 == 0x0) {
-                printf("mul x%d, x%d, x%d\n", rd, rs1, rs2);
-            } else if (funct3 == 0x4) {
-                printf("div x%d, x%d, x%d\n", rd, rs1, rs2);
-            } else if (funct3 == 0x5) {
-                printf("divu x%d, x%d, x%d\n", rd, rs1, rs2);
-            }
-        }
-    }
-    
-    else if (opcode == 0x13) {// I-type instructions
-        rd = (current_ins >> 7) & 0x1F;
-        funct3 = (current_ins >> 12) & 0x07;
-        rs1 = (current_ins >> 15) & 0x1F;
-        imm_sext = ((int32_t)current_ins) >> 20;
-
-        if (funct3 == 0x0) {
-            printf("addi x%d, x%d, %d\n", rd, rs1, imm_sext);
-        } else if (funct3 == 0x2) {
-            printf("slti x%d, x%d, %d\n", rd, rs1, imm_sext);
-        } else if (funct3 == 0x4) {
-            printf("xori x%d, x%d, %d\n", rd, rs1, imm_sext);
-        } else if (funct3 == 0x6) {
-            printf("ori x%d, x%d, %d\n", rd, rs1, imm_sext);
-        } else if (funct3 == 0x7) {
-            printf("andi x%d, x%d, %d\n", rd, rs1, imm_sext);
-        } else if (funct3 == 0x1) {
-            shamt = imm_sext & 0x1F;
-            printf("slli x%d, x%d, %d\n", rd, rs1, shamt);
-        } else if (funct3 == 0x5) {
-            shamt = imm_sext & 0x1F;
-            funct7 = (current_ins >> 25) & 0x7F;
-            if (funct7 == 0x00) {
-                printf("srli x%d, x%d, %d\n", rd, rs1, shamt);
-            } else if (funct7 == 0x20) {
-                printf("srai x%d, x%d, %d\n", rd, rs1, shamt);
-            }
-        }
-    }
-    
-    else if (opcode == 0x03) { // I-type load instructions
-        rd = (current_ins >> 7) & 0x1F;
-        funct3 = (current_ins >> 12) & 0x07;
-        rs1 = (current_ins >> 15) & 0x1F;
-        imm_sext = ((int32_t)current_ins) >> 20;
-
-        if (funct3 == 0x0) {
-            printf("lb x%d, %d(x%d)\n", rd, imm_sext, rs1);
-        } else if (funct3 == 0x1) {
-            printf("lh x%d, %d(x%d)\n", rd, imm_sext, rs1);
-        } else if (funct3 == 0x2) {
-            printf("lw x%d, %d(x%d)\n", rd, imm_sext, rs1);
-        } else if (funct3 == 0x4) {
-            printf("lbu x%d, %d(x%d)\n", rd, imm_sext, rs1);
-        } else if (funct3 == 0x5) {
-            printf("lhu x%d, %d(x%d)\n", rd, imm_sext, rs1);
-        }
-    }
-    
-    else if (opcode == 0x23) {// S-type store instructions
-        funct3 = (current_ins >> 12) & 0x07;
-        rs1 = (current_ins >> 15) & 0x1F;
-        rs2 = (current_ins >> 20) & 0x1F;
-        imm = ((current_ins >> 7) & 0x1F) | (((current_ins >> 25) & 0x7F) << 5);
-        imm_sext = ((int32_t)(imm << 20)) >> 20;
-
-        if (funct3 == 0x0) {
-            printf("sb x%d, %d(x%d)\n", rs2, imm_sext, rs1);
-        } else if (funct3 == 0x1) {
-            printf("sh x%d, %d(x%d)\n", rs2, imm_sext, rs1);
-        } else if (funct3 == 0x2) {
-            printf("sw x%d, %d(x%d)\n", rs2, imm_sext, rs1);
-        }
-    }
-    
-    else if (opcode == 0x63) {// SB-type branch instructions
-        funct3 = (current_ins >> 12) & 0x7;
-        rs1 = (current_ins >> 15) & 0x1F;
-        rs2 = (current_ins >> 20) & 0x1F;
-
-        int32_t imm_12 = ((current_ins >> 31) & 0x1) << 12;
-        int32_t imm_11 = ((current_ins >> 7) & 0x1) << 11;
-        int32_t imm_10_5 = ((current_ins >> 25) & 0x3F) << 5;
-        int32_t imm_4_1 = ((current_ins >> 8) & 0xF) << 1;
-        int32_t imm = imm_12 + imm_11 + imm_10_5 + imm_4_1;
-        imm = (imm << 19) >> 19;
-
-        if (funct3 == 0x0) {
-            printf("beq x%d, x%d, %d\n", rs1, rs2, imm);
-        } else if (funct3 == 0x1) {
-            printf("bne x%d, x%d, %d\n", rs1, rs2, imm);
-        } else if (funct3 == 0x4) {
-            printf("blt x%d, x%d, %d\n", rs1, rs2, imm);
-        } else if (funct3 == 0x5) {
-            printf("bge x%d, x%d, %d\n", rs1, rs2, imm);
-        } else if (funct3 == 0x6) {
-            printf("bltu x%d, x%d, %d\n", rs1, rs2, imm);
-        } else if (funct3 == 0x7) {
-            printf("bgeu x%d, x%d, %d\n", rs1, rs2, imm);
-        }
-    }
-    
-    else if (opcode == 0x6F) {//JAL
-        uint32_t rd = (current_ins >> 7) & 0x1F;
-        int32_t imm20 = ((current_ins >> 31) & 0x1) << 20;
-        int32_t imm10_1 = ((current_ins >> 21) & 0x3FF) << 1;
-        int32_t imm11 = ((current_ins >> 20) & 0x1) << 11;
-        int32_t imm19_12 = ((current_ins >> 12) & 0xFF) << 12;
-        int32_t imm = imm20 + imm19_12 + imm11 + imm10_1;
-        imm = (imm << 11) >> 11;
+    decode_instruction(current_ins, &d);
+    name = OP_INFO[d.op].name;
 
-        printf("jal x%d, %d\n", rd, imm);
-    }
-    
-    else if (opcode == 0x67) {// JALR 
-        uint32_t rd = (current_ins >> 7) & 0x1F;
-        uint32_t funct3 = (current_ins >> 12) & 0x7;
-        uint32_t rs1 = (current_ins >> 15) & 0x1F;
-        int32_t imm = (int32_t)current_ins >> 20;
-
-        if (funct3 == 0x0) {
-            printf("jalr x%d, x%d, %d\n", rd, rs1, imm);
-        }
-    }
-    
-    else if (opcode == 0x37) {// LUI 
-        uint32_t rd = (current_ins >> 7) & 0x1F;
-        int32_t imm = current_ins & 0xFFFFF000;
-        printf("lui x%d, %d\n", rd, imm >> 12);
-    }
-    
-    else if (opcode == 0x17) {// AUIPC 
-        uint32_t rd = (current_ins >> 7) & 0x1F;
-        int32_t imm = current_ins & 0xFFFFF000;
-        printf("auipc x%d, %d\n", rd, imm >> 12);
-    }
-    
-    else if (opcode == 0x73) {// ECALL Instruction
-        printf("ecall\n");
+    switch (OP_INFO[d.op].fmt) {
+        case FMT_R:
+            printf("%s x%d, x%d, x%d\n", name, d.rd, d.rs1, d.rs2);
+            break;
+        case FMT_I:
+        case FMT_SHIFT:
+        case FMT_JALR:
+            printf("%s x%d, x%d, %d\n", name, d.rd, d.rs1, d.imm);
+            break;
+        case FMT_LOAD:
+            printf("%s x%d, %d(x%d)\n", name, d.rd, d.imm, d.rs1);
+            break;
+        case FMT_S:
+            printf("%s x%d, %d(x%d)\n", name, d.rs2, d.imm, d.rs1);
+            break;
+        case FMT_B:
+            printf("%s x%d, x%d, %d\n", name, d.rs1, d.rs2, d.imm);
+            break;
+        case FMT_U:
+            printf("%s x%d, %d\n", name, d.rd, d.imm >> 12);
+            break;
+        case FMT_J:
+            printf("%s x%d, %d\n", name, d.rd, d.imm);
+            break;
+        case FMT_SYS:
+            printf("%s\n", name);
+            break;
+        case FMT_CSR:
+            printf("%s x%d, 0x%x, x%d\n", name, d.rd, d.imm, d.rs1);
+            break;
+        case FMT_CSRI:
+            printf("%s x%d, 0x%x, %d\n", name, d.rd, d.imm, d.rs1);
+            break;
+        case FMT_RAW:
+            printf(".word 0x%08x\n", current_ins);
+            break;
+        default:
+            printf("%s\n", name);
+            break;
     }
 }
 
@@ -710,21 +1582,124 @@ void print_instruction(uint32_t addr){
 /* main()                                                      */
 /***************************************************************/
 int main(int argc, char *argv[]) {                              
-    printf("\n********************************\n");
-    printf("Welcome to OZU-RISCV SIMULATOR...\n");
-    printf("*********************************\n\n");
-    
-    if (argc < 2) {
-        printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
+    static const struct option long_options[] = {
+        { "exec",       required_argument, NULL, 'e' },
+        { "file",       required_argument, NULL, 'f' },
+        { "quiet",      no_argument,       NULL, 'q' },
+        { "until-exit", no_argument,       NULL, 'x' },
+        { "json",       no_argument,       NULL, 'j' },
+        { "misaligned", required_argument, NULL, 'a' },
+        { "stats",      required_argument, NULL, 's' },
+        { "stats-file", required_argument, NULL, 'o' },
+        { "share",      required_argument, NULL, 'd' },
+        { NULL, 0, NULL, 0 }
+    };
+    /* -e/-f arguments, executed in command line order once the program is loaded */
+    char **scripts = calloc(argc, sizeof(char *));
+    int *script_is_file = calloc(argc, sizeof(int));
+    int num_scripts = 0, until_exit = FALSE, bad_option = FALSE;
+    int i, opt;
+
+    while (!bad_option && (opt = getopt_long(argc, argv, "e:f:q", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'e':
+            case 'f':
+                script_is_file[num_scripts] = (opt == 'f');
+                scripts[num_scripts++] = optarg;
+                break;
+            case 'q':
+                QUIET = TRUE;
+                break;
+            case 'x':
+                until_exit = TRUE;
+                break;
+            case 'j':
+                JSON_DUMPS = TRUE;
+                break;
+            case 'a':
+                if (strcmp(optarg, "emulate") == 0) {
+                    MEM_ALIGN_POLICY = MEM_ALIGN_EMULATE;
+                } else if (strcmp(optarg, "allow") == 0) {
+                    MEM_ALIGN_POLICY = MEM_ALIGN_ALLOW;
+                } else if (strcmp(optarg, "trap") == 0) {
+                    MEM_ALIGN_POLICY = MEM_ALIGN_TRAP;
+                } else {
+                    printf("Error: unknown misaligned access policy %s\n\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 's':
+                if (strcmp(optarg, "json") == 0) {
+                    STATS_ON_EXIT = STATS_JSON;
+                } else if (strcmp(optarg, "prom") == 0) {
+                    STATS_ON_EXIT = STATS_PROM;
+                } else {
+                    printf("Error: unknown stats format %s\n\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                STATS_FILE = optarg;
+                break;
+            case 'd':
+                SHARE_DIR = optarg;
+                break;
+            default:
+                bad_option = TRUE;
+                break;
+        }
+    }
+
+    if (!QUIET) {
+        printf("\n********************************\n");
+        printf("Welcome to OZU-RISCV SIMULATOR...\n");
+        printf("*********************************\n\n");
+    }
+
+    if (bad_option || optind != argc - 1 || strlen(argv[optind]) >= sizeof(prog_file)) {
+        printf("Error: You should provide input file.\n");
+        printf("Usage: %s [options] <input program> \n\n",  argv[0]);
+        printf("-e, --exec <commands>\t-- execute ';' separated commands, then exit\n");
+        printf("-f, --file <file>\t-- execute the commands in <file>, then exit\n");
+        printf("-q, --quiet\t\t-- no banners, prompts or program load output\n");
+        printf("--until-exit\t\t-- run the program to completion, exit with its exit code\n");
+        printf("--json\t\t\t-- rdump/mdump print JSON\n");
+        printf("--misaligned=emulate|allow|trap\t-- handling of misaligned loads/stores\n");
+        printf("--stats=json|prom\t-- print performance counters on exit\n");
+        printf("--stats-file=<file>\t-- write the --stats output to <file>\n");
+        printf("--share=<dir>\t\t-- share the program image and its decoded form with other instances through <dir>\n\n");
         exit(1);
     }
 
-    strcpy(prog_file, argv[1]);
+    strcpy(prog_file, argv[optind]);
+    if (STATS_ON_EXIT != STATS_NONE) {
+        atexit(export_stats_on_exit);
+    }
     initialize();
     load_program();
-    help();
+
+    if (num_scripts > 0 || until_exit) {
+        for (i = 0; i < num_scripts; i++) {
+            if (script_is_file[i]) {
+                execute_command_file(scripts[i]);
+            } else {
+                execute_commands(scripts[i]);
+            }
+        }
+        if (!until_exit) {
+            exit(0);
+        }
+        if (RUN_FLAG) {
+            runAll();
+        }
+        exit(EXIT_STATUS);
+    }
+
+    if (!QUIET) {
+        help();
+    }
     while (1){
         handle_command();
     }
     return 0;
-}
\ No newline at end of file
+}
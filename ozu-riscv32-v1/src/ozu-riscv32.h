@@ -1,4 +1,6 @@
 #include <stdint.h>
+#include <stdio.h>
+#include <inttypes.h>
 
 #define FALSE 0
 #define TRUE  1
@@ -7,7 +9,7 @@
 /* RISCV memory layout                                                        */
 /******************************************************************************/
 #define MEM_TEXT_BEGIN  0x00010000
-#define MEM_TEXT_END      0x10000000
+#define MEM_TEXT_END    0x0FFFFFFF
 /*Memory address 0x10000000 to 0xBFFFFFFF access by $gp*/
 #define MEM_DATA_BEGIN  0x10000000
 #define MEM_DATA_END   0xBFFFFFFF
@@ -21,13 +23,22 @@ typedef struct {
 	uint8_t *mem;
 } mem_region_t;
 
-/* memory will be dynamically allocated at initialization */
+/* memory is reserved at initialization, host pages are only committed when touched */
 mem_region_t MEM_REGIONS[] = {
 	{ MEM_TEXT_BEGIN, MEM_TEXT_END, NULL },
 	{ MEM_DATA_BEGIN, MEM_DATA_END, NULL }
 };
 
 #define NUM_MEM_REGION 2
+
+/* handling of loads/stores whose address is not a multiple of their size */
+typedef enum {
+    MEM_ALIGN_EMULATE,  /* split into byte accesses, may cross region boundaries */
+    MEM_ALIGN_ALLOW,    /* direct host access, dropped if it leaves its region   */
+    MEM_ALIGN_TRAP      /* report the access and stop the simulation             */
+} mem_align_policy_t;
+
+mem_align_policy_t MEM_ALIGN_POLICY = MEM_ALIGN_EMULATE;
 #define RISCV_REGS 32
 
 typedef struct CPU_State_Struct {
@@ -44,29 +55,305 @@ typedef struct CPU_State_Struct {
 
 CPU_State CURRENT_STATE, NEXT_STATE;
 int RUN_FLAG;	/* run flag*/
-uint32_t INSTRUCTION_COUNT;
+uint64_t INSTRUCTION_COUNT;
 uint32_t PROGRAM_SIZE; /*in words*/
+uint64_t PROGRAM_HASH; /* content hash of the program image */
+#define HASH_SEED 0xCBF29CE484222325ULL
+
+char prog_file[FILENAME_MAX]; /*name of input file*/
+
+/***************************************************************/
+/* Command line / scripting options.                           */
+/***************************************************************/
+#define MAX_COMMAND_ARGS 8
+#define EXIT_STATUS_FAULT 255   /* process exit status when the simulation stops on a fault */
+
+int QUIET;          /* no banners, prompts or per-word load output */
+int JSON_DUMPS;     /* rdump/mdump print JSON unless told otherwise */
+int EXIT_STATUS;    /* exit code of the simulated program (low byte of a0 at ecall) */
+const char *SHARE_DIR;  /* directory of program images and predecoded programs shared between instances */
+
+
+/***************************************************************/
+/* Privilege modes, CSRs and traps                             */
+/***************************************************************/
+#define PRIV_U 0
+#define PRIV_M 3
+
+#define CSR_MSTATUS     0x300
+#define CSR_MISA        0x301
+#define CSR_MCOUNTEREN  0x306
+#define CSR_MIE         0x304
+#define CSR_MTVEC       0x305
+#define CSR_MSCRATCH    0x340
+#define CSR_MEPC        0x341
+#define CSR_MCAUSE      0x342
+#define CSR_MTVAL       0x343
+#define CSR_MIP         0x344
+#define CSR_MTIMECMP    0x7C0   /* custom machine read/write: timer compare, low word  */
+#define CSR_MTIMECMPH   0x7C1   /* custom machine read/write: timer compare, high word */
+#define CSR_MCYCLE      0xB00   /* 0xB00..0xB1F machine counters, 0xB80.. high words */
+#define CSR_MCYCLEH     0xB80
+#define CSR_CYCLE       0xC00   /* 0xC00..0xC1F user counters, 0xC80.. high words    */
+#define CSR_TIME        0xC01
+#define CSR_INSTRET     0xC02
+#define CSR_HPMCOUNTER3 0xC03
+#define CSR_CYCLEH      0xC80
+#define CSR_TIMEH       0xC81
+#define CSR_MHARTID     0xF14
+
+#define MSTATUS_MIE     (1 << 3)
+#define MSTATUS_MPIE    (1 << 7)
+#define MSTATUS_MPP     (3 << 11)
+#define MSTATUS_MPP_SHIFT 11
+
+#define MIP_MSIP        (1 << 3)
+#define MIP_MTIP        (1 << 7)
+#define MIP_MEIP        (1 << 11)
+
+#define MISA_RV32IMU    ((1u << 30) | (1 << ('I' - 'A')) | (1 << ('M' - 'A')) | (1 << ('U' - 'A')))
+
+/* mcause values */
+#define CAUSE_FETCH_MISALIGNED  0
+#define CAUSE_ILLEGAL_INS       2
+#define CAUSE_BREAKPOINT        3
+#define CAUSE_LOAD_MISALIGNED   4
+#define CAUSE_STORE_MISALIGNED  6
+#define CAUSE_ECALL_U           8
+#define CAUSE_ECALL_M           11
+#define NUM_CAUSES              12
+#define CAUSE_INTERRUPT         0x80000000
+#define IRQ_MSI                 3
+#define IRQ_MTI                 7
+#define IRQ_MEI                 11
+
+typedef struct {
+    uint32_t mstatus, mie, mip, mtvec, mscratch, mepc, mcause, mtval, mcounteren;
+    uint64_t mtimecmp;
+} CSR_State;
+
+CSR_State CSR;
+uint32_t PRIV;          /* current privilege mode */
+uint64_t MTIME;         /* timer, one tick per executed instruction */
+uint64_t EVENT_DEADLINE;/* MTIME at which interrupts must be re-evaluated, 0 if one is pending */
+int TRAP_RAISED;        /* set when the current instruction traps: it neither writes rd nor retires */
+
+/***************************************************************/
+/* Instruction decoder                                         */
+/***************************************************************/
 
-char prog_file[32]; /*name of input file*/
+/* operand/immediate layout of an instruction, also selects its assembly syntax */
+typedef enum {
+    FMT_NONE,   /* fence                */
+    FMT_RAW,    /* illegal, imm holds the instruction word */
+    FMT_R,      /* op rd, rs1, rs2      */
+    FMT_I,      /* op rd, rs1, imm      */
+    FMT_SHIFT,  /* op rd, rs1, shamt    */
+    FMT_LOAD,   /* op rd, imm(rs1)      */
+    FMT_S,      /* op rs2, imm(rs1)     */
+    FMT_B,      /* op rs1, rs2, offset  */
+    FMT_U,      /* op rd, imm[31:12]    */
+    FMT_J,      /* op rd, offset        */
+    FMT_JALR,   /* op rd, rs1, imm      */
+    FMT_SYS,    /* op                   */
+    FMT_CSR,    /* op rd, csr, rs1      */
+    FMT_CSRI,   /* op rd, csr, uimm     */
+    NUM_FMTS
+} ins_format_t;
+
+/* RV32IM, Zicsr and machine-mode instructions: name, mnemonic, mask, match, format */
+#define RV32IM_OPS(X) \
+    X(ILLEGAL, "illegal", 0x00000000, 0x00000000, FMT_RAW)   \
+    X(LUI,     "lui",     0x0000007F, 0x00000037, FMT_U)     \
+    X(AUIPC,   "auipc",   0x0000007F, 0x00000017, FMT_U)     \
+    X(JAL,     "jal",     0x0000007F, 0x0000006F, FMT_J)     \
+    X(JALR,    "jalr",    0x0000707F, 0x00000067, FMT_JALR)  \
+    X(BEQ,     "beq",     0x0000707F, 0x00000063, FMT_B)     \
+    X(BNE,     "bne",     0x0000707F, 0x00001063, FMT_B)     \
+    X(BLT,     "blt",     0x0000707F, 0x00004063, FMT_B)     \
+    X(BGE,     "bge",     0x0000707F, 0x00005063, FMT_B)     \
+    X(BLTU,    "bltu",    0x0000707F, 0x00006063, FMT_B)     \
+    X(BGEU,    "bgeu",    0x0000707F, 0x00007063, FMT_B)     \
+    X(LB,      "lb",      0x0000707F, 0x00000003, FMT_LOAD)  \
+    X(LH,      "lh",      0x0000707F, 0x00001003, FMT_LOAD)  \
+    X(LW,      "lw",      0x0000707F, 0x00002003, FMT_LOAD)  \
+    X(LBU,     "lbu",     0x0000707F, 0x00004003, FMT_LOAD)  \
+    X(LHU,     "lhu",     0x0000707F, 0x00005003, FMT_LOAD)  \
+    X(SB,      "sb",      0x0000707F, 0x00000023, FMT_S)     \
+    X(SH,      "sh",      0x0000707F, 0x00001023, FMT_S)     \
+    X(SW,      "sw",      0x0000707F, 0x00002023, FMT_S)     \
+    X(ADDI,    "addi",    0x0000707F, 0x00000013, FMT_I)     \
+    X(SLTI,    "slti",    0x0000707F, 0x00002013, FMT_I)     \
+    X(SLTIU,   "sltiu",   0x0000707F, 0x00003013, FMT_I)     \
+    X(XORI,    "xori",    0x0000707F, 0x00004013, FMT_I)     \
+    X(ORI,     "ori",     0x0000707F, 0x00006013, FMT_I)     \
+    X(ANDI,    "andi",    0x0000707F, 0x00007013, FMT_I)     \
+    X(SLLI,    "slli",    0xFE00707F, 0x00001013, FMT_SHIFT) \
+    X(SRLI,    "srli",    0xFE00707F, 0x00005013, FMT_SHIFT) \
+    X(SRAI,    "srai",    0xFE00707F, 0x40005013, FMT_SHIFT) \
+    X(ADD,     "add",     0xFE00707F, 0x00000033, FMT_R)     \
+    X(SUB,     "sub",     0xFE00707F, 0x40000033, FMT_R)     \
+    X(SLL,     "sll",     0xFE00707F, 0x00001033, FMT_R)     \
+    X(SLT,     "slt",     0xFE00707F, 0x00002033, FMT_R)     \
+    X(SLTU,    "sltu",    0xFE00707F, 0x00003033, FMT_R)     \
+    X(XOR,     "xor",     0xFE00707F, 0x00004033, FMT_R)     \
+    X(SRL,     "srl",     0xFE00707F, 0x00005033, FMT_R)     \
+    X(SRA,     "sra",     0xFE00707F, 0x40005033, FMT_R)     \
+    X(OR,      "or",      0xFE00707F, 0x00006033, FMT_R)     \
+    X(AND,     "and",     0xFE00707F, 0x00007033, FMT_R)     \
+    X(MUL,     "mul",     0xFE00707F, 0x02000033, FMT_R)     \
+    X(MULH,    "mulh",    0xFE00707F, 0x02001033, FMT_R)     \
+    X(MULHSU,  "mulhsu",  0xFE00707F, 0x02002033, FMT_R)     \
+    X(MULHU,   "mulhu",   0xFE00707F, 0x02003033, FMT_R)     \
+    X(DIV,     "div",     0xFE00707F, 0x02004033, FMT_R)     \
+    X(DIVU,    "divu",    0xFE00707F, 0x02005033, FMT_R)     \
+    X(REM,     "rem",     0xFE00707F, 0x02006033, FMT_R)     \
+    X(REMU,    "remu",    0xFE00707F, 0x02007033, FMT_R)     \
+    X(FENCE,   "fence",   0x0000707F, 0x0000000F, FMT_NONE)  \
+    X(FENCE_I, "fence.i", 0x0000707F, 0x0000100F, FMT_NONE)  \
+    X(ECALL,   "ecall",   0xFFFFFFFF, 0x00000073, FMT_SYS)   \
+    X(EBREAK,  "ebreak",  0xFFFFFFFF, 0x00100073, FMT_SYS)   \
+    X(MRET,    "mret",    0xFFFFFFFF, 0x30200073, FMT_SYS)   \
+    X(WFI,     "wfi",     0xFFFFFFFF, 0x10500073, FMT_SYS)   \
+    X(CSRRW,   "csrrw",   0x0000707F, 0x00001073, FMT_CSR)   \
+    X(CSRRS,   "csrrs",   0x0000707F, 0x00002073, FMT_CSR)   \
+    X(CSRRC,   "csrrc",   0x0000707F, 0x00003073, FMT_CSR)   \
+    X(CSRRWI,  "csrrwi",  0x0000707F, 0x00005073, FMT_CSRI)  \
+    X(CSRRSI,  "csrrsi",  0x0000707F, 0x00006073, FMT_CSRI)  \
+    X(CSRRCI,  "csrrci",  0x0000707F, 0x00007073, FMT_CSRI)
+
+#define OP_ENUM(op, name, mask, match, fmt) OP_##op,
+typedef enum {
+    RV32IM_OPS(OP_ENUM)
+    NUM_OPS
+} ins_op_t;
+#undef OP_ENUM
+
+typedef struct {
+    const char *name;
+    uint32_t mask, match;
+    uint8_t fmt;
+} op_info_t;
+
+/* compact decoded form shared by the executor and the disassembler */
+typedef struct {
+    uint8_t op;     /* ins_op_t */
+    uint8_t rd, rs1, rs2;
+    int32_t imm;    /* sign extended immediate, shamt for shifts, CSR number */
+} decoded_ins_t;
+
+/* direct mapped cache of decoded instructions, tagged with their PC */
+#define DECODE_CACHE_SIZE    4096
+#define DECODE_CACHE_INVALID 0xFFFFFFFF   /* never a valid PC */
+
+typedef struct {
+    uint32_t pc;
+    decoded_ins_t d;
+} decode_cache_entry_t;
+
+/* every word of the loaded program, decoded once; private or mapped from SHARE_DIR */
+#define PREDECODED_MAGIC 0x4445434F   /* "OCED" */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t entry_size;    /* sizeof(decoded_ins_t) */
+    uint64_t ops_hash;      /* hash of the op table, op numbers differ between builds */
+    uint64_t image_hash;
+    uint32_t words;
+    uint32_t reserved;
+} predecoded_header_t;
+
+decoded_ins_t *PREDECODED;
+uint32_t PREDECODED_WORDS;  /* entries still valid, cut back by stores into the program */
+
+
+/***************************************************************/
+/* Performance counters                                        */
+/***************************************************************/
+
+/* classes of retired instructions, in export and hpmcounter3.. order */
+#define INS_CLASSES(X) \
+    X(ALU,              "alu")              \
+    X(LOAD,             "load")             \
+    X(STORE,            "store")            \
+    X(BRANCH_TAKEN,     "branch_taken")     \
+    X(BRANCH_NOT_TAKEN, "branch_not_taken") \
+    X(JUMP,             "jump")             \
+    X(MULDIV,           "muldiv")           \
+    X(SYSTEM,           "system")
+
+#define CLASS_ENUM(cls, name) CLS_##cls,
+typedef enum {
+    INS_CLASSES(CLASS_ENUM)
+    NUM_CLASSES
+} ins_class_t;
+#undef CLASS_ENUM
+
+typedef enum { STATS_NONE, STATS_JSON, STATS_PROM } stats_format_t;
+
+typedef struct {
+    uint64_t ops[NUM_OPS];      /* retired instructions per op, classes are derived on export */
+    uint64_t exceptions[NUM_CAUSES]; /* instructions that trapped instead of retiring, per mcause */
+    uint64_t branches_taken;
+    uint64_t decode_misses;     /* decoded instruction cache misses */
+    uint64_t misaligned;        /* accesses that took the misaligned slow path */
+    uint64_t unmapped;          /* accesses outside every memory region */
+    uint64_t host_ns;           /* host wall time spent simulating */
+} Counters;
 
+Counters COUNTERS;
 
 /***************************************************************/
 /* Function Declerations.                                                                                                */
 /***************************************************************/
 void help();
+uint8_t mem_read_8(uint32_t address);
+uint16_t mem_read_16(uint32_t address);
 uint32_t mem_read_32(uint32_t address);
+void mem_write_8(uint32_t address, uint8_t value);
+void mem_write_16(uint32_t address, uint16_t value);
 void mem_write_32(uint32_t address, uint32_t value);
+uint32_t mem_read_misaligned(uint32_t address, uint32_t size);
+void mem_write_misaligned(uint32_t address, uint32_t value, uint32_t size);
 void cycle();
 void run(int num_cycles);
 void runAll();
 void mdump(uint32_t start, uint32_t stop) ;
 void rdump();
 void handle_command();
+void execute_command(char *command);
+void execute_commands(char *commands);
+void execute_command_file(const char *file_name);
+void quit(int status);
+void mdump_json(uint32_t start, uint32_t stop);
+void rdump_json();
 void reset();
 void init_memory();
+void clear_memory();
+uint64_t hash_bytes(const void *data, size_t size, uint64_t hash);
+int map_shared_image(const uint8_t *image, uint32_t size);
 void load_program();
 void handle_instruction(); /*YOU SHOULD IMPLEMENT THIS*/
 void initialize();
 void print_program(); /*YOU SHOULD IMPLEMENT THIS*/
 void print_instruction(uint32_t);
+void init_decoder();
+void decode_instruction(uint32_t ins, decoded_ins_t *d);
+void flush_decode_cache();
+void load_predecoded(const uint8_t *image, uint32_t words, int shared);
+void invalidate_decode_cache(uint32_t address);
+void execute_instruction(const decoded_ins_t *d);
+void reset_trap_state();
+void raise_exception(uint32_t cause, uint32_t tval);
+void trap_enter(uint32_t cause, uint32_t tval, uint32_t epc);
+void update_interrupts();
+void check_interrupts();
+void set_external_interrupt(int level);
+int csr_read(uint32_t csr, uint32_t *value);
+int csr_write(uint32_t csr, uint32_t value);
+uint32_t mem_peek_32(uint32_t address);
+uint64_t class_count(int cls);
+uint64_t retired_count();
+void reset_counters();
+void print_stats(FILE *fp, stats_format_t format);
 
@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/******************************************************************************/
+/* OZU-RV32 random program generator                                          */
+/*                                                                            */
+/* Emits a valid RV32IM program in the .hex format read by load_program() of  */
+/* the simulator (one 32-bit word per line). Programs always terminate:       */
+/* random branches and jumps only go forward, loops are counted down in       */
+/* reserved registers, and the program ends with "addi x17, x0, 93; ecall".  */
+/******************************************************************************/
+
+#define FALSE 0
+#define TRUE  1
+
+#define MEM_DATA_BEGIN  0x10000000
+#define MAX_FOOTPRINT   0x10000000
+
+/* register roles */
+#define REG_BASE        2   /* moving base for loads/stores               */
+#define REG_GP          3   /* fixed pointer to MEM_DATA_BEGIN            */
+#define REG_LOOP_FIRST  28  /* x28..x31 hold loop counters, one per level */
+#define MAX_LOOP_DEPTH  4
+
+/* chunk of the data footprint reachable through a single base register */
+#define MEM_CHUNK       2048
+
+enum { CLS_ALU, CLS_MUL, CLS_LOAD, CLS_STORE, CLS_BRANCH, CLS_JUMP, CLS_LOOP, NUM_CLS };
+
+static const char *CLS_NAMES[NUM_CLS] = {
+    "alu", "mul", "load", "store", "branch", "jump", "loop"
+};
+
+typedef struct {
+    unsigned weights[NUM_CLS];
+    unsigned num_ins;       /* top level instruction slots      */
+    unsigned body_len;      /* instruction slots per loop body  */
+    unsigned loop_depth;    /* maximum loop nesting             */
+    unsigned loop_iters;    /* iterations of every loop         */
+    uint32_t footprint;     /* data bytes touched by load/store */
+    uint32_t seed;
+    unsigned misaligned;    /* percent of misaligned loads/stores */
+} gen_config_t;
+
+gen_config_t CFG = {
+    { 8, 1, 3, 2, 2, 1, 1 }, /* alu mul load store branch jump loop */
+    256, 8, 2, 4, 4096, 1, 0
+};
+
+uint32_t *PROGRAM;
+uint32_t PROGRAM_LEN, PROGRAM_CAP;
+uint32_t RNG_STATE;
+int32_t BASE_CHUNK; /* chunk currently held in REG_BASE */
+
+/***************************************************************/
+/* Pseudo random numbers (xorshift32, reproducible per seed)   */
+/***************************************************************/
+uint32_t rnd() {
+    RNG_STATE ^= RNG_STATE << 13;
+    RNG_STATE ^= RNG_STATE >> 17;
+    RNG_STATE ^= RNG_STATE << 5;
+    return RNG_STATE;
+}
+
+uint32_t rnd_range(uint32_t n) {
+    return n ? rnd() % n : 0;
+}
+
+/* scratch register: anything but x0, the base registers and the loop counters */
+uint32_t rnd_reg() {
+    static const uint8_t scratch[] = {
+        1, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+        16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27
+    };
+    return scratch[rnd_range(sizeof(scratch))];
+}
+
+/* source register: scratch registers plus the read-only ones */
+uint32_t rnd_src() {
+    uint32_t r = rnd_range(8);
+    if (r == 0) return 0;
+    if (r == 1) return REG_GP;
+    return rnd_reg();
+}
+
+/***************************************************************/
+/* Instruction encoders                                        */
+/***************************************************************/
+uint32_t enc_r(uint32_t funct7, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode) {
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+uint32_t enc_i(int32_t imm, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode) {
+    return ((uint32_t)(imm & 0xFFF) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+uint32_t enc_s(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t opcode) {
+    return (((imm >> 5) & 0x7F) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) |
+           ((imm & 0x1F) << 7) | opcode;
+}
+
+uint32_t enc_b(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t funct3) {
+    return (((imm >> 12) & 0x1) << 31) | (((imm >> 5) & 0x3F) << 25) | (rs2 << 20) | (rs1 << 15) |
+           (funct3 << 12) | (((imm >> 1) & 0xF) << 8) | (((imm >> 11) & 0x1) << 7) | 0x63;
+}
+
+uint32_t enc_u(uint32_t imm, uint32_t rd, uint32_t opcode) {
+    return (imm & 0xFFFFF000) | (rd << 7) | opcode;
+}
+
+uint32_t enc_j(int32_t imm, uint32_t rd) {
+    return (((imm >> 20) & 0x1) << 31) | (((imm >> 1) & 0x3FF) << 21) | (((imm >> 11) & 0x1) << 20) |
+           (((imm >> 12) & 0xFF) << 12) | (rd << 7) | 0x6F;
+}
+
+/***************************************************************/
+/* Program buffer                                              */
+/***************************************************************/
+uint32_t emit(uint32_t ins) {
+    if (PROGRAM_LEN == PROGRAM_CAP) {
+        PROGRAM_CAP = PROGRAM_CAP ? PROGRAM_CAP * 2 : 1024;
+        PROGRAM = realloc(PROGRAM, PROGRAM_CAP * sizeof(uint32_t));
+        if (PROGRAM == NULL) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+    }
+    PROGRAM[PROGRAM_LEN] = ins;
+    return PROGRAM_LEN++;
+}
+
+/* load a 32-bit constant using lui/addi */
+void emit_li(uint32_t rd, uint32_t value) {
+    uint32_t hi = (value + 0x800) & 0xFFFFF000;
+    int32_t lo = (int32_t)(value - hi);
+    emit(enc_u(hi, rd, 0x37));
+    if (lo != 0) {
+        emit(enc_i(lo, rd, 0x0, rd, 0x13));
+    }
+}
+
+/***************************************************************/
+/* Instruction classes                                         */
+/***************************************************************/
+void gen_alu() {
+    static const uint8_t r_funct3[] = { 0x0, 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x5, 0x6, 0x7 };
+    static const uint8_t r_funct7[] = { 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00 };
+    static const uint8_t i_funct3[] = { 0x0, 0x2, 0x3, 0x4, 0x6, 0x7 };
+    uint32_t rd = rnd_reg();
+    uint32_t k, shift_funct7;
+
+    switch (rnd_range(4)) {
+        case 0: /* register-register */
+            k = rnd_range(sizeof(r_funct3));
+            emit(enc_r(r_funct7[k], rnd_src(), rnd_src(), r_funct3[k], rd, 0x33));
+            break;
+        case 1: /* register-immediate */
+            k = rnd_range(sizeof(i_funct3));
+            emit(enc_i((int32_t)rnd_range(4096) - 2048, rnd_src(), i_funct3[k], rd, 0x13));
+            break;
+        case 2: /* shift immediate */
+            k = rnd_range(3);
+            shift_funct7 = (k == 2) ? 0x20 : 0x00;
+            emit(enc_i((int32_t)((shift_funct7 << 5) | rnd_range(32)), rnd_src(),
+                       k == 0 ? 0x1 : 0x5, rd, 0x13));
+            break;
+        default: /* upper immediate */
+            emit(enc_u(rnd(), rd, rnd_range(2) ? 0x37 : 0x17));
+            break;
+    }
+}
+
+void gen_mul() {
+    uint32_t funct3 = rnd_range(8);
+    uint32_t rd = rnd_reg();
+    uint32_t rs2 = rnd_src();
+
+    if (funct3 >= 0x4) {
+        /* divisor forced into [1, 2047]: no division by zero or overflow */
+        uint32_t tmp = rnd_reg();
+        emit(enc_i(0x7FF, rs2, 0x7, tmp, 0x13));
+        emit(enc_i(1, tmp, 0x6, tmp, 0x13));
+        rs2 = tmp;
+    }
+    emit(enc_r(0x01, rs2, rnd_src(), funct3, rd, 0x33));
+}
+
+/* pick an offset inside the footprint and point REG_BASE at its chunk; */
+/* offsets are aligned except for CFG.misaligned percent of them         */
+int32_t gen_address(uint32_t size) {
+    uint32_t offset = rnd_range(CFG.footprint) & ~(size - 1);
+    int32_t chunk;
+
+    /* no extra draws without -a, seeds keep giving the same programs */
+    if (CFG.misaligned && size > 1 && CFG.footprint >= 2 * size &&
+        rnd_range(100) < CFG.misaligned) {
+        /* 1..size-1 bytes past an aligned slot, the last byte still inside */
+        offset = rnd_range(CFG.footprint / size - 1) * size + 1 + rnd_range(size - 1);
+    }
+    chunk = offset / MEM_CHUNK;
+
+    if (chunk != BASE_CHUNK) {
+        emit_li(REG_BASE, MEM_DATA_BEGIN + chunk * MEM_CHUNK);
+        BASE_CHUNK = chunk;
+    }
+    return offset % MEM_CHUNK;
+}
+
+void gen_load() {
+    static const uint8_t funct3[] = { 0x0, 0x1, 0x2, 0x4, 0x5 };
+    static const uint8_t size[]   = { 1, 2, 4, 1, 2 };
+    uint32_t k = rnd_range(sizeof(funct3));
+    int32_t imm = gen_address(size[k]);
+    emit(enc_i(imm, REG_BASE, funct3[k], rnd_reg(), 0x03));
+}
+
+void gen_store() {
+    uint32_t funct3 = rnd_range(3);
+    int32_t imm = gen_address(1 << funct3);
+    emit(enc_s(imm, rnd_src(), REG_BASE, funct3, 0x23));
+}
+
+void gen_straight();
+
+/* forward branch over 1..4 straight-line instructions */
+void gen_branch() {
+    static const uint8_t funct3[] = { 0x0, 0x1, 0x4, 0x5, 0x6, 0x7 };
+    uint32_t k = rnd_range(sizeof(funct3));
+    uint32_t rs1 = rnd_src(), rs2 = rnd_src();
+    uint32_t at = emit(0);
+    uint32_t n = 1 + rnd_range(4);
+
+    while (n--) {
+        gen_straight();
+    }
+    PROGRAM[at] = enc_b((PROGRAM_LEN - at) * 4, rs2, rs1, funct3[k]);
+    /* the skipped code may have moved the base register */
+    BASE_CHUNK = -1;
+}
+
+/* forward jal, or auipc+jalr, over 1..4 straight-line instructions */
+void gen_jump() {
+    uint32_t n = 1 + rnd_range(4);
+    uint32_t rd = rnd_range(2) ? rnd_reg() : 0;
+
+    if (rnd_range(2)) {
+        uint32_t at = emit(0);
+        while (n--) {
+            gen_straight();
+        }
+        PROGRAM[at] = enc_j((PROGRAM_LEN - at) * 4, rd);
+    } else {
+        uint32_t link = rnd_reg();
+        uint32_t at = emit(enc_u(0, link, 0x17));
+        uint32_t jalr = emit(0);
+        while (n--) {
+            gen_straight();
+        }
+        PROGRAM[jalr] = enc_i((PROGRAM_LEN - at) * 4, link, 0x0, rd, 0x67);
+    }
+    BASE_CHUNK = -1;
+}
+
+/* a single instruction class that does not change control flow */
+void gen_straight() {
+    uint32_t total = CFG.weights[CLS_ALU] + CFG.weights[CLS_MUL] +
+                     CFG.weights[CLS_LOAD] + CFG.weights[CLS_STORE];
+    uint32_t pick = rnd_range(total);
+
+    if (total == 0 || pick < CFG.weights[CLS_ALU]) {
+        gen_alu();
+        return;
+    }
+    pick -= CFG.weights[CLS_ALU];
+    if (pick < CFG.weights[CLS_MUL]) {
+        gen_mul();
+        return;
+    }
+    pick -= CFG.weights[CLS_MUL];
+    if (pick < CFG.weights[CLS_LOAD]) {
+        gen_load();
+    } else {
+        gen_store();
+    }
+}
+
+void gen_block(uint32_t slots, uint32_t depth);
+
+/* counted loop: the counter register of this level is never touched by random code */
+void gen_loop(uint32_t depth) {
+    uint32_t counter = REG_LOOP_FIRST + depth;
+    uint32_t head;
+
+    emit(enc_i(CFG.loop_iters, 0, 0x0, counter, 0x13));
+    head = PROGRAM_LEN;
+    /* the base register may be changed inside the body, forget it at the head */
+    BASE_CHUNK = -1;
+    gen_block(CFG.body_len, depth + 1);
+    emit(enc_i(-1, counter, 0x0, counter, 0x13));
+    if ((PROGRAM_LEN - head) * 4 <= 4096) {
+        emit(enc_b(-(int32_t)(PROGRAM_LEN - head) * 4, 0, counter, 0x1));
+    } else if ((PROGRAM_LEN + 1 - head) * 4 <= 0x100000) {
+        /* body out of branch range: skip over a backward jal when done */
+        emit(enc_b(8, 0, counter, 0x0));
+        emit(enc_j(-(int32_t)(PROGRAM_LEN - head) * 4, 0));
+    } else {
+        /* out of jal range too: auipc+jalr through a scratch register */
+        uint32_t tmp = rnd_reg();
+        int32_t offset = -(int32_t)(PROGRAM_LEN + 1 - head) * 4;
+        uint32_t hi = ((uint32_t)offset + 0x800) & 0xFFFFF000;
+        emit(enc_b(12, 0, counter, 0x0));
+        emit(enc_u(hi, tmp, 0x17));
+        emit(enc_i(offset - (int32_t)hi, tmp, 0x0, 0, 0x67));
+    }
+    BASE_CHUNK = -1;
+}
+
+void gen_block(uint32_t slots, uint32_t depth) {
+    uint32_t i, c, pick, total;
+
+    for (i = 0; i < slots; i++) {
+        total = 0;
+        for (c = 0; c < NUM_CLS; c++) {
+            if (c != CLS_LOOP || depth < CFG.loop_depth) {
+                total += CFG.weights[c];
+            }
+        }
+        pick = rnd_range(total);
+        for (c = 0; c < NUM_CLS - 1; c++) {
+            if (pick < CFG.weights[c]) {
+                break;
+            }
+            pick -= CFG.weights[c];
+        }
+
+        switch (c) {
+            case CLS_ALU:    gen_alu();         break;
+            case CLS_MUL:    gen_mul();         break;
+            case CLS_LOAD:   gen_load();        break;
+            case CLS_STORE:  gen_store();       break;
+            case CLS_BRANCH: gen_branch();      break;
+            case CLS_JUMP:   gen_jump();        break;
+            default:
+                /* only reached with loops excluded if every other weight is 0 */
+                if (depth < CFG.loop_depth) {
+                    gen_loop(depth);
+                } else {
+                    gen_straight();
+                }
+                break;
+        }
+    }
+}
+
+void generate() {
+    RNG_STATE = CFG.seed ? CFG.seed : 1;
+    PROGRAM_LEN = 0;
+
+    emit_li(REG_GP, MEM_DATA_BEGIN);
+    emit(enc_i(0, REG_GP, 0x0, REG_BASE, 0x13));
+    BASE_CHUNK = 0;
+
+    gen_block(CFG.num_ins, 0);
+
+    emit(enc_i(93, 0, 0x0, 17, 0x13));
+    emit(0x00000073);
+}
+
+/***************************************************************/
+/* Command line                                                */
+/***************************************************************/
+void usage(const char *prog) {
+    printf("Usage: %s [options]\n\n", prog);
+    printf("-o <file>\t-- write the program to <file> (default: stdout)\n");
+    printf("-s <seed>\t-- random seed (default: 1)\n");
+    printf("-n <n>\t\t-- top level instruction slots (default: 256)\n");
+    printf("-w <mix>\t-- instruction mix weights, e.g. alu=8,mul=1,load=3,store=2,branch=2,jump=1,loop=1\n");
+    printf("-m <bytes>\t-- data memory footprint of loads/stores (default: 4096)\n");
+    printf("-a <percent>\t-- misaligned halfword/word loads/stores (default: 0)\n");
+    printf("-l <depth>\t-- maximum loop nesting, at most %d (default: 2)\n", MAX_LOOP_DEPTH);
+    printf("-b <n>\t\t-- instruction slots per loop body (default: 8)\n");
+    printf("-i <n>\t\t-- iterations of every loop (default: 4)\n\n");
+}
+
+int parse_weights(char *mix) {
+    char *item, *value;
+    int c;
+
+    for (item = strtok(mix, ","); item != NULL; item = strtok(NULL, ",")) {
+        value = strchr(item, '=');
+        if (value == NULL) {
+            return FALSE;
+        }
+        *value++ = '\0';
+        for (c = 0; c < NUM_CLS; c++) {
+            if (strcmp(item, CLS_NAMES[c]) == 0) {
+                break;
+            }
+        }
+        if (c == NUM_CLS) {
+            return FALSE;
+        }
+        CFG.weights[c] = strtoul(value, NULL, 0);
+    }
+    return TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    const char *out_file = NULL;
+    FILE *fp = stdout;
+    uint32_t i, c, straight = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:s:n:w:m:a:l:b:i:h")) != -1) {
+        switch (opt) {
+            case 'o': out_file = optarg;                               break;
+            case 's': CFG.seed = strtoul(optarg, NULL, 0);             break;
+            case 'n': CFG.num_ins = strtoul(optarg, NULL, 0);          break;
+            case 'm': CFG.footprint = strtoul(optarg, NULL, 0);        break;
+            case 'a': CFG.misaligned = strtoul(optarg, NULL, 0);       break;
+            case 'l': CFG.loop_depth = strtoul(optarg, NULL, 0);       break;
+            case 'b': CFG.body_len = strtoul(optarg, NULL, 0);         break;
+            case 'i': CFG.loop_iters = strtoul(optarg, NULL, 0);       break;
+            case 'w':
+                if (!parse_weights(optarg)) {
+                    printf("Error: invalid instruction mix %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(opt == 'h' ? 0 : 1);
+        }
+    }
+
+    if (CFG.loop_depth > MAX_LOOP_DEPTH) {
+        CFG.loop_depth = MAX_LOOP_DEPTH;
+    }
+    /* loops need a non-loop instruction at the innermost level */
+    for (c = 0; c < NUM_CLS; c++) {
+        if (c != CLS_LOOP) {
+            straight += CFG.weights[c];
+        }
+    }
+    if (straight == 0) {
+        printf("Error: instruction mix needs a non-zero weight besides loop\n");
+        exit(1);
+    }
+    if (CFG.loop_iters < 1 || CFG.loop_iters > 2047) {
+        printf("Error: loop iterations must be in [1, 2047]\n");
+        exit(1);
+    }
+    if (CFG.footprint < 4 || CFG.footprint > MAX_FOOTPRINT) {
+        printf("Error: memory footprint must be in [4, 0x%x]\n", MAX_FOOTPRINT);
+        exit(1);
+    }
+
+    if (CFG.misaligned > 100) {
+        printf("Error: misaligned percentage must be in [0, 100]\n");
+        exit(1);
+    }
+
+    generate();
+
+    if (out_file != NULL) {
+        fp = fopen(out_file, "w");
+        if (fp == NULL) {
+            printf("Error: Can't open output file %s\n", out_file);
+            exit(1);
+        }
+    }
+    for (i = 0; i < PROGRAM_LEN; i++) {
+        fprintf(fp, "%08x\n", PROGRAM[i]);
+    }
+    if (fp != stdout) {
+        fclose(fp);
+    }
+    free(PROGRAM);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#!/bin/sh
+###############################################################################
+# OZU-RV32 throughput stress suite
+#
+# usage: ./stress.sh [reference simulator]
+#
+# Generates programs with ozu-rvgen for a set of preset instruction mixes,
+# runs each one to completion with ./ozu-riscv32 under the misaligned access
+# policy of the preset and records its MIPS.
+# If a reference simulator is given, the final registers and data memory of
+# both simulators are compared for every program.
+#
+# SEEDS        seeds per preset (default: 3)
+# STRESS_DIR   where programs and results.tsv are kept (default: a new
+#              temporary directory)
+###############################################################################
+
+SIM=./ozu-riscv32
+GEN=./ozu-rvgen
+REF=$1
+SEEDS=${SEEDS:-3}
+STRESS_DIR=${STRESS_DIR:-$(mktemp -d)}
+FOOTPRINT=65536
+
+# name, --misaligned policy and ozu-rvgen options of every preset
+PRESETS="
+ldst        emulate -n 2000 -l 2 -b 16 -i 64 -w alu=2,mul=0,load=6,store=6,branch=1,jump=0,loop=1
+branch      emulate -n 2000 -l 2 -b 16 -i 64 -w alu=3,mul=0,load=1,store=1,branch=8,jump=3,loop=1
+muldiv      emulate -n 2000 -l 2 -b 16 -i 64 -w alu=2,mul=8,load=1,store=1,branch=1,jump=0,loop=1
+loops       emulate -n 400 -l 4 -b 6 -i 12 -w alu=6,mul=1,load=2,store=2,branch=1,jump=1,loop=3
+mixed       emulate -n 2000 -l 3 -b 8 -i 32
+mis-emulate emulate -n 2000 -l 2 -b 16 -i 64 -w alu=2,mul=0,load=6,store=6,branch=1,jump=0,loop=1 -a 10
+mis-allow   allow   -n 2000 -l 2 -b 16 -i 64 -w alu=2,mul=0,load=6,store=6,branch=1,jump=0,loop=1 -a 10
+mis-trap    trap    -n 2000 -l 2 -b 16 -i 64 -w alu=2,mul=0,load=6,store=6,branch=1,jump=0,loop=1 -a 1
+"
+
+if [ ! -x $SIM ] || [ ! -x $GEN ]; then
+    echo "Error: build $SIM and $GEN first (make)"
+    exit 1
+fi
+if [ -n "$REF" ] && [ ! -x "$REF" ]; then
+    echo "Error: reference simulator $REF is not executable"
+    exit 1
+fi
+mkdir -p "$STRESS_DIR"
+
+# final registers and data memory, as JSON
+dump() {
+    "$1" -q --misaligned=$policy -e "sim; rdump json; mdump 10000000 $(printf '%x' $((0x10000000 + FOOTPRINT - 4))) json" "$2" </dev/null 2>/dev/null
+}
+
+printf "preset\tseed\tinstructions\tmips\tresult\n" > "$STRESS_DIR/results.tsv"
+while read -r name policy options; do
+    [ -z "$name" ] && continue
+    seed=1
+    while [ $seed -le $SEEDS ]; do
+        hex="$STRESS_DIR/$name-$seed.hex"
+        $GEN -s $seed -m $FOOTPRINT $options -o "$hex" || exit 1
+
+        # under trap the first misaligned access stops the program, with a message on stderr
+        $SIM -q --misaligned=$policy --until-exit --stats=json --stats-file="$STRESS_DIR/stats.json" "$hex" </dev/null
+        instructions=$(sed 's/.*"instructions":\([0-9]*\).*/\1/' "$STRESS_DIR/stats.json")
+        mips=$(sed 's/.*"mips":\([0-9.]*\).*/\1/' "$STRESS_DIR/stats.json")
+
+        result=-
+        if [ -n "$REF" ]; then
+            dump $SIM "$hex" > "$STRESS_DIR/sim.out"
+            dump "$REF" "$hex" > "$STRESS_DIR/ref.out"
+            if cmp -s "$STRESS_DIR/sim.out" "$STRESS_DIR/ref.out"; then
+                result=OK
+            else
+                result=DIFF
+            fi
+        fi
+        printf "%s\t%s\t%s\t%s\t%s\n" $name $seed $instructions $mips $result | tee -a "$STRESS_DIR/results.tsv"
+        seed=$((seed + 1))
+    done
+done <<END
+$PRESETS
+END
+
+echo "results in $STRESS_DIR/results.tsv"
+if grep -q "DIFF$" "$STRESS_DIR/results.tsv"; then
+    echo "Error: results differ from $REF"
+    exit 1
+fi